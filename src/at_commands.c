@@ -2,9 +2,12 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
-#include <ctype.h>
 #include "at_commands.h"
 #include "comms.h"
+#include "hex.h"
+#include "urc.h"
+#include "stats.h"
+#include "trace.h"
 
 #include <logging/log.h>
 #define LOG_LEVEL LOG_LEVEL_DBG
@@ -13,349 +16,787 @@ LOG_MODULE_REGISTER(at_commands);
 #define CMD_TIMEOUT K_MSEC(2000)
 #define CMD_REBOOT_TIMEOUT K_MSEC(15000)
 
-/* this is a helper buffer to keep track of the input from the UART. The buffer
-   is quite short and can't keep track of longer strings. It is mainly concerned
-   with catching +NSONMI URCs from the modem */
-#define B_SIZE 10
+// Maximum number of bytes claimed from the receive buffer at a time
+#define SPAN_SIZE 64
 
-struct buf
+// The start of each line is kept until the tokenizer knows what kind of line
+// it is (final result, response for the current command or something else).
+// This only has to fit the longest prefix.
+#define HEAD_SIZE 16
+
+// Longest URC line passed to the dispatcher. Longer lines are truncated.
+#define URC_LINE_SIZE 64
+
+// Returned by the tokenizer when it needs more input
+#define AT_MORE 1
+
+// Parsing progress for a single field. There is one for each layout in the
+// schema since the alternative layout is parsed in parallel.
+struct field_state
+{
+    int32_t ival;
+    bool neg;
+    size_t pos;
+    int8_t nibble;
+    // Set if the field has characters that can't be decoded
+    bool invalid;
+};
+
+enum tok_state
+{
+    // At the start of a line, collecting the head
+    TOK_HEAD,
+    // Parsing fields of a response line
+    TOK_FIELDS,
+    // Ignoring the rest of the line
+    TOK_SKIP,
+    // Collecting a URC line for the dispatcher
+    TOK_URC,
+};
+
+struct at_tokenizer
 {
-    uint8_t data[B_SIZE];
-    uint8_t index;
-    uint16_t size;
+    const struct at_schema *schema;
+    enum tok_state state;
+    char head[HEAD_SIZE];
+    uint8_t headlen;
+    char urc[URC_LINE_SIZE];
+    uint8_t urclen;
+    uint8_t field;
+    bool quoted;
+    // Set when a response line has been parsed. Later lines are skipped.
+    bool matched;
+    // Set by +CME ERROR lines. They're the final result.
+    bool error;
+    // Set while collecting a line with the prefix that might be a URC
+    bool maybe_urc;
+    int fields;
+    struct field_state fs[2];
+    // Set for each layout if a field in the response line couldn't be
+    // decoded
+    bool invalid[2];
+#if CONFIG_N2_TRACE_SIZE > 0
+    // Start of the current line for the trace and its full length
+    char line[TRACE_DATA_SIZE];
+    uint16_t linelen;
+#endif
 };
 
-void b_reset(struct buf *rb)
+static void field_reset(struct field_state *st)
 {
-    rb->index = 0;
-    rb->size = 0;
-    memset(rb->data, 0, B_SIZE);
+    st->ival = 0;
+    st->neg = false;
+    st->pos = 0;
+    st->nibble = -1;
+    st->invalid = false;
 }
 
-void b_init(struct buf *rb)
+/**
+ * @brief Append a run of characters to a field. The run doesn't contain any
+ *        delimiters.
+ */
+static void field_put(const struct at_field *f, struct field_state *st, const char *run, size_t n)
 {
-    b_reset(rb);
+    if (!f->dest)
+    {
+        return;
+    }
+    switch (f->type)
+    {
+    case AT_FIELD_INT:
+        // pos counts the digits
+        for (size_t i = 0; i < n; i++)
+        {
+            int digit = run[i] - '0';
+            if (run[i] == '-' && st->pos == 0 && !st->neg)
+            {
+                st->neg = true;
+            }
+            else if (digit < 0 || digit > 9 || st->ival > (INT32_MAX - digit) / 10)
+            {
+                // Not a number or too large for an int
+                st->invalid = true;
+                return;
+            }
+            else
+            {
+                st->ival = st->ival * 10 + digit;
+                st->pos++;
+            }
+        }
+        break;
+    case AT_FIELD_STR:
+        if (st->pos < f->size - 1)
+        {
+            size_t len = MIN(n, f->size - 1 - st->pos);
+            memcpy((char *)f->dest + st->pos, run, len);
+            st->pos += len;
+        }
+        break;
+    case AT_FIELD_HEX:
+    {
+        if (st->nibble >= 0 && n > 0)
+        {
+            // Second digit of a pair split across runs
+            int lo = hex_nibble(run[0]);
+            if (lo < 0)
+            {
+                st->invalid = true;
+            }
+            else if (st->pos < f->size)
+            {
+                ((uint8_t *)f->dest)[st->pos++] = (uint8_t)(st->nibble << 4 | lo);
+            }
+            st->nibble = -1;
+            run++;
+            n--;
+        }
+        size_t pairs = MIN(n / 2, f->size - st->pos);
+        int decoded = hex_decode(run, pairs * 2, (uint8_t *)f->dest + st->pos);
+        if (decoded < 0)
+        {
+            st->invalid = true;
+            return;
+        }
+        st->pos += decoded;
+        if (n & 1)
+        {
+            st->nibble = hex_nibble(run[n - 1]);
+            st->invalid |= st->nibble < 0;
+        }
+        break;
+    }
+    case AT_FIELD_SKIP:
+        break;
+    }
 }
-void b_add(struct buf *rb, uint8_t b)
+
+/**
+ * @brief Store a completed field in its destination.
+ * @return false if the field couldn't be decoded
+ */
+static bool field_end(const struct at_field *f, struct field_state *st)
 {
-    if (rb->index < B_SIZE)
+    bool valid = !st->invalid;
+    if (f->dest)
     {
-        rb->data[rb->index++] = b;
+        switch (f->type)
+        {
+        case AT_FIELD_INT:
+            *(int *)f->dest = st->neg ? -st->ival : st->ival;
+            // A lone minus sign
+            valid &= !st->neg || st->pos > 0;
+            break;
+        case AT_FIELD_STR:
+            ((char *)f->dest)[st->pos] = 0;
+            break;
+        case AT_FIELD_HEX:
+            // An odd number of digits
+            valid &= st->nibble < 0;
+            break;
+        default:
+            break;
+        }
+        if (f->len)
+        {
+            *f->len = st->pos;
+        }
     }
-    rb->size++;
+    field_reset(st);
+    return valid;
 }
 
-bool b_is(struct buf *rb, const char *str, const size_t len)
+static const struct at_field *layout_field(const struct at_schema *layout, uint8_t field)
 {
-    if (strncmp((char *)rb->data, str, len) == 0)
+    if (!layout || field >= layout->count)
     {
-        return true;
+        return NULL;
     }
-    return false;
+    return &layout->fields[field];
 }
 
-bool b_is_urc(struct buf *rb)
+/**
+ * @brief Feed a run of field characters to both layouts.
+ */
+static void tok_put(struct at_tokenizer *t, const char *run, size_t n)
 {
-    return (rb->size > 0 && rb->data[0] == '+');
+    const struct at_field *f = layout_field(t->schema, t->field);
+    if (f)
+    {
+        field_put(f, &t->fs[0], run, n);
+    }
+    f = layout_field(t->schema->alt, t->field);
+    if (f)
+    {
+        field_put(f, &t->fs[1], run, n);
+    }
 }
 
-// Callbacks for the input processing. The context is used to maintain variables
-// between the invocations and are passed by the decode_input function below.
+static void tok_field_end(struct at_tokenizer *t)
+{
+    const struct at_field *f = layout_field(t->schema, t->field);
+    if (f && !field_end(f, &t->fs[0]))
+    {
+        t->invalid[0] = true;
+    }
+    f = layout_field(t->schema->alt, t->field);
+    if (f && !field_end(f, &t->fs[1]))
+    {
+        t->invalid[1] = true;
+    }
+    t->field++;
+}
 
-// The end of line callback - called every time an end-of-line character is found
-typedef void (*eol_callback_t)(void *ctx, struct buf *rb, bool is_urc);
+static void tok_line_reset(struct at_tokenizer *t)
+{
+    t->state = TOK_HEAD;
+    t->headlen = 0;
+    t->field = 0;
+    t->quoted = false;
+    t->maybe_urc = false;
+    field_reset(&t->fs[0]);
+    field_reset(&t->fs[1]);
+}
 
-// Character callback - called for every character in the input. Both the character callback
-// and the EOL callback is called when the processing reaches an end of line character
-typedef void (*char_callback_t)(void *ctx, struct buf *rb, char b, bool is_urc, bool is_space);
+static void tok_init(struct at_tokenizer *t, const struct at_schema *schema)
+{
+    t->schema = schema;
+    t->matched = false;
+    t->error = false;
+    t->fields = 0;
+    t->invalid[0] = false;
+    t->invalid[1] = false;
+#if CONFIG_N2_TRACE_SIZE > 0
+    t->linelen = 0;
+#endif
+    tok_line_reset(t);
+}
 
-// Each decoder is largely the same so we use a strategy pattern for each. The char
-// callback is called for each character input and the EOL callback is called when a
-// new line is found. The buffer will contain the *first* 9 characters of the line
-// so it might be truncated.
-int decode_input(int32_t timeout, void *ctx, char_callback_t char_cb, eol_callback_t eol_cb)
+#if CONFIG_N2_TRACE_SIZE > 0
+/**
+ * @brief Keep the start of the line for the trace. Runs end at the end of the
+ *        line at most, so line endings are only stripped from the edges.
+ */
+static void tok_capture(struct at_tokenizer *t, const char *run, size_t n)
 {
-    if (timeout < 0) {
-        timeout = -timeout;
+    while (n > 0 && (run[0] == '\r' || run[0] == '\n'))
+    {
+        run++;
+        n--;
+    }
+    while (n > 0 && (run[n - 1] == '\r' || run[n - 1] == '\n'))
+    {
+        n--;
+    }
+    if (t->linelen < TRACE_DATA_SIZE)
+    {
+        memcpy(t->line + t->linelen, run, MIN(n, TRACE_DATA_SIZE - t->linelen));
     }
-    struct buf rb;
-    b_init(&rb);
-    uint8_t b, prev = ' ';
-    bool is_urc = false;
+    t->linelen = MIN((size_t)t->linelen + n, UINT16_MAX);
+}
 
-    while (modem_read(&b, timeout))
+/**
+ * @brief Add the completed line to the trace. Empty lines are left out.
+ */
+static void tok_trace_line(struct at_tokenizer *t, enum trace_type type)
+{
+    if (t->linelen > 0)
     {
-        if (b == '+' && rb.size == 0)
-        {
-            is_urc = true;
-        }
-        b_add(&rb, b);
-        if (char_cb)
-        {
-            char_cb(ctx, &rb, b, is_urc, isspace(b));
-        }
-        if (rb.size >= 4)
+        trace_put(type, t->linelen, t->line, t->linelen);
+    }
+    t->linelen = 0;
+}
+#else
+#define tok_capture(t, run, n)
+#define tok_trace_line(t, type)
+#endif
+
+/**
+ * @brief Parse field characters from a span. Stops at the end of the line.
+ * @return Number of characters consumed
+ */
+static size_t tok_fields(struct at_tokenizer *t, const char *span, size_t len)
+{
+    size_t i = 0;
+    while (i < len)
+    {
+        // Find the next delimiter and hand everything before it over in
+        // one go. Hex payloads are decoded a run at a time.
+        size_t run = i;
+        if (t->quoted)
         {
-            if (b_is(&rb, "OK\r\n", 4))
-            {
-                return AT_OK;
-            }
-            if (b_is(&rb, "ERROR\r\n", 7))
+            while (run < len && span[run] != '"' && span[run] != '\r' && span[run] != '\n')
             {
-                return AT_ERROR;
+                run++;
             }
         }
-        if (prev == '\r' && b == '\n')
+        else
         {
-            if (eol_cb)
+            while (run < len && span[run] != '"' && span[run] != ',' &&
+                   span[run] != ' ' && span[run] != '\r' && span[run] != '\n')
             {
-                eol_cb(ctx, &rb, is_urc);
+                run++;
             }
-            b_reset(&rb);
-            is_urc = false;
         }
-        // Additional URCs to support:
-        //  - CEREG
-        //  - NPSMR
-        //  - CSCON
-        //  - UFOTAS
-
-        prev = b;
+        if (run > i)
+        {
+            tok_put(t, span + i, run - i);
+        }
+        i = run;
+        if (i == len)
+        {
+            break;
+        }
+        switch (span[i++])
+        {
+        case '"':
+            t->quoted = !t->quoted;
+            break;
+        case ',':
+            tok_field_end(t);
+            break;
+        case '\n':
+            tok_field_end(t);
+            t->matched = true;
+            t->fields = t->field;
+            tok_line_reset(t);
+            return i;
+        default:
+            // Spaces outside strings and \r
+            break;
+        }
     }
-    return AT_TIMEOUT;
+    return i;
 }
 
-// Decode AT+NRB responses. It just waits for OK or ERROR with a slightly
-// longer timeout than the default commands.
-int atnrb_decode()
+static bool head_is(struct at_tokenizer *t, const char *str)
 {
-    return decode_input(CMD_REBOOT_TIMEOUT, NULL, NULL, NULL);
+    return t->headlen == strlen(str) && strncmp(t->head, str, t->headlen) == 0;
 }
 
-// AT responses - wait for OK (ERROR is quite rare here but it is handled)
-#define at_decode() decode_input(CMD_TIMEOUT, NULL, NULL, NULL)
-
-// Decode response for AT+NSOCL (close socket). There is no return from this
-// command, just OK or ERROR.
-int atnsocl_decode()
+// True if the head so far might still turn into OK or ERROR
+static bool head_maybe_result(struct at_tokenizer *t)
 {
-    return at_decode();
+    return (t->headlen <= 2 && strncmp(t->head, "OK", t->headlen) == 0) ||
+           (t->headlen <= 5 && strncmp(t->head, "ERROR", t->headlen) == 0);
 }
 
-// Decode the CGPADDR response. The in_address flag says if we're in the address
-// string (ie past the +CGPADDR: string) and copies the bytes into the address
-// buffer. When the eol callback is set the address flag is reset
-
-struct cgp_ctx
-{
-    bool in_address;
-    uint8_t addrindex;
-    char *address;
-    char *buffer;
-    size_t *len;
-    uint8_t i;
-};
-
-void cgpaddr_eol(void *ctx, struct buf *rb, bool is_urc)
+/**
+ * @brief Decide what to do with the line once enough of the head is known.
+ */
+static void tok_classify(struct at_tokenizer *t, char c)
 {
-    struct cgp_ctx *c = (struct cgp_ctx *)ctx;
-    if (c->in_address)
+    const char *prefix = t->schema->prefix;
+    if (t->head[0] == '+')
     {
-        bool in_str = false;
-        uint8_t n = 0;
-        for (int i = 0; i < (c->i); i++)
+        if (c != ':')
         {
-            if (in_str && c->buffer[i] == '\"')
+            if (t->headlen == HEAD_SIZE)
             {
-                in_str = false;
+                t->state = TOK_SKIP;
             }
-            if (in_str)
+            return;
+        }
+        if (prefix && head_is(t, prefix))
+        {
+            // Only the first line is decoded. Later lines of the response
+            // aren't URCs either.
+            if (t->matched)
+            {
+                t->state = TOK_SKIP;
+            }
+            else if (t->schema->min_fields > 0)
             {
-                c->address[n++] = c->buffer[i];
+                // Collect the line and count the fields first
+                memcpy(t->urc, t->head, t->headlen);
+                t->urclen = t->headlen;
+                t->maybe_urc = true;
+                t->state = TOK_URC;
             }
-            if (!in_str && (c->buffer[i] == '\"'))
+            else
             {
-                in_str = true;
+                t->state = TOK_FIELDS;
             }
+            return;
         }
-        c->address[n] = 0;
-        *c->len = n;
+        if (head_is(t, "+CME ERROR:"))
+        {
+            t->error = true;
+            t->state = TOK_SKIP;
+            return;
+        }
+        // Anything else starting with + is a URC. The head is the start of
+        // the line.
+        memcpy(t->urc, t->head, t->headlen);
+        t->urclen = t->headlen;
+        t->state = TOK_URC;
+        return;
     }
-    c->in_address = false;
-}
-
-void cgpaddr_char(void *ctx, struct buf *rb, char b, bool is_urc, bool is_space)
-{
-    struct cgp_ctx *c = (struct cgp_ctx *)ctx;
-    if (c->in_address && !is_space)
+    if (t->headlen < HEAD_SIZE && head_maybe_result(t))
     {
-        c->buffer[c->i++] = (char)b;
+        return;
     }
-    if (is_urc && rb->size == 9 && b_is(rb, "+CGPADDR:", 9))
+    if (prefix || t->matched)
     {
-        c->in_address = true;
+        t->state = TOK_SKIP;
+        return;
     }
+    // A plain response line. Replay the head as field data.
+    t->state = TOK_FIELDS;
+    tok_fields(t, t->head, t->headlen);
 }
 
-int atcgpaddr_decode(char *address, size_t *len)
+/**
+ * @brief Count the fields in a line without the head.
+ */
+static int line_fields(const char *line, size_t len)
 {
-    char buffer[20];
-    memset(buffer, 0, sizeof(buffer));
-    struct cgp_ctx ctx = {
-        .in_address = false,
-        .address = address,
-        .len = len,
-        .buffer = buffer,
-        .i = 0,
-    };
-    return decode_input(CMD_TIMEOUT, &ctx, cgpaddr_char, cgpaddr_eol);
+    int count = 1;
+    bool quoted = false;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (line[i] == '"')
+        {
+            quoted = !quoted;
+        }
+        else if (line[i] == ',' && !quoted)
+        {
+            count++;
+        }
+    }
+    return count;
 }
 
-// Decode NSCR responses. This is fairly straightforward since there's only
-// a single digit that is returned. We'll pass the pointer to the return
-// function as the context and assign it when the line ends.
-
-void nsocr_eol(void *ctx, struct buf *rb, bool is_urc)
+/**
+ * @brief Finish a line collected as a URC. A line with the response prefix
+ *        and enough fields is the response after all.
+ */
+static void tok_urc_end(struct at_tokenizer *t)
 {
-    if (!is_urc && rb->size > 2)
+    t->urc[t->urclen] = 0;
+    if (t->maybe_urc)
+    {
+        size_t headlen = strlen(t->schema->prefix);
+        const char *rest = t->urc + headlen;
+        size_t restlen = t->urclen - headlen;
+        if (line_fields(rest, restlen) >= t->schema->min_fields)
+        {
+            tok_trace_line(t, TRACE_RX);
+            if (t->urclen == URC_LINE_SIZE - 1)
+            {
+                // Cut short
+                t->invalid[0] = true;
+                t->invalid[1] = true;
+            }
+            t->state = TOK_FIELDS;
+            tok_fields(t, rest, restlen);
+            tok_fields(t, "\n", 1);
+            return;
+        }
+    }
+    tok_trace_line(t, TRACE_URC);
+    if (urc_dispatch(t->urc, t->urclen) > 0)
     {
-        int *sockfd = (int *)ctx;
-        *sockfd = atoi((const char *)rb->data);
+        stats_urc(false);
     }
+    tok_line_reset(t);
 }
 
-int atnsocr_decode(int *sockfd)
+/**
+ * @brief Feed a span of input to the tokenizer.
+ * @param *used: Set to the number of characters consumed when the final
+ *        result is found.
+ * @return AT_OK or AT_ERROR when the final result is found, AT_MORE if more
+ *         input is required.
+ */
+static int tok_feed(struct at_tokenizer *t, const char *span, size_t len, size_t *used)
 {
-    *sockfd = -2;
-    return decode_input(CMD_TIMEOUT, sockfd, NULL, nsocr_eol);
+    size_t i = 0;
+    while (i < len)
+    {
+        char c = span[i];
+        switch (t->state)
+        {
+        case TOK_FIELDS:
+        {
+            // Up to and including the end of the line
+            const char *end = memchr(span + i, '\n', len - i);
+            size_t n = end ? (size_t)(end - span) + 1 - i : len - i;
+            tok_capture(t, span + i, n);
+            i += tok_fields(t, span + i, n);
+            if (t->state == TOK_HEAD)
+            {
+                tok_trace_line(t, TRACE_RX);
+            }
+            continue;
+        }
+        case TOK_URC:
+            if (c == '\n')
+            {
+                tok_urc_end(t);
+            }
+            else if (c != '\r' && t->urclen < URC_LINE_SIZE - 1)
+            {
+                t->urc[t->urclen++] = c;
+            }
+            break;
+        case TOK_SKIP:
+            if (c == '\n')
+            {
+                tok_trace_line(t, TRACE_RX);
+                if (t->error)
+                {
+                    // +CME ERROR is the final result
+                    *used = i + 1;
+                    return AT_ERROR;
+                }
+                tok_line_reset(t);
+            }
+            break;
+        case TOK_HEAD:
+            if (c == '\r')
+            {
+                break;
+            }
+            if (c == '\n')
+            {
+                tok_trace_line(t, TRACE_RX);
+                if (head_is(t, "OK"))
+                {
+                    *used = i + 1;
+                    return AT_OK;
+                }
+                if (head_is(t, "ERROR"))
+                {
+                    *used = i + 1;
+                    return AT_ERROR;
+                }
+                if (t->headlen > 0 && t->head[0] != '+' && !t->schema->prefix && !t->matched)
+                {
+                    // Short plain response line
+                    t->state = TOK_FIELDS;
+                    tok_fields(t, t->head, t->headlen);
+                    tok_fields(t, "\n", 1);
+                }
+                tok_line_reset(t);
+                break;
+            }
+            t->head[t->headlen++] = c;
+            tok_classify(t, c);
+            break;
+        }
+        tok_capture(t, &c, 1);
+        i++;
+    }
+    return AT_MORE;
 }
 
-// Decode SOST responses. Also quite simple since everything fits into
-// the entire 9-byte buffer so we just process the line at EOL.
+static const struct at_schema no_fields = {
+    .prefix = NULL,
+    .fields = NULL,
+    .count = 0,
+};
 
-struct nsost_ctx
+// URCs in a response are passed to the dispatcher in urc.c as soon as the
+// line is complete.
+int at_parse(int32_t timeout, const struct at_schema *schema, int *fields)
 {
-    int *sockfd;
-    size_t *len;
-};
+    if (timeout < 0) {
+        timeout = -timeout;
+    }
+    struct at_tokenizer t;
+    tok_init(&t, schema ? schema : &no_fields);
+    uint8_t *span;
+    size_t len;
+    size_t used;
+
+    // Input is parsed in place, one claimed region of the receive buffer
+    // at a time. Whatever follows the final OK or ERROR is left in the
+    // buffer for the next command.
+    while ((len = modem_read_claim(&span, SPAN_SIZE, timeout)) > 0)
+    {
+        int res = tok_feed(&t, (const char *)span, len, &used);
+        if (res != AT_MORE)
+        {
+            modem_read_finish(used);
+            // The layout that was used is the alternative one if the line
+            // has as many fields as it does
+            const struct at_schema *alt = t.schema->alt;
+            if (res == AT_OK && t.invalid[alt && t.fields == alt->count])
+            {
+                LOG_WRN("Malformed response");
+                res = AT_ERROR;
+            }
+            if (fields)
+            {
+                *fields = t.fields;
+            }
+            return res;
+        }
+        modem_read_finish(len);
+    }
+    return AT_TIMEOUT;
+}
 
-void nsost_eol(void *ctx, struct buf *rb, bool is_urc)
+void at_idle(void)
 {
-    struct nsost_ctx *c = (struct nsost_ctx *)ctx;
-        // Socket descriptor is *always* a single digit, ie the comma would be
-        // the 2nd char
-    if (!is_urc && *c->len == 0 && rb->size > 2 && rb->data[1] == ',') {
-        *c->sockfd = (int)(rb->data[0] - '0');
-        if (*c->sockfd >= 7) {
-            LOG_ERR("Socket fd should be <= 6 but is '%c'", rb->data[0]);
+    struct at_tokenizer t;
+    tok_init(&t, &no_fields);
+    uint8_t *span;
+    size_t len;
+    size_t used;
+
+    while (true)
+    {
+        // Only wait for more input in the middle of a line
+        bool boundary = t.state == TOK_HEAD && t.headlen == 0;
+        len = modem_read_claim(&span, SPAN_SIZE, boundary ? K_NO_WAIT : CMD_TIMEOUT);
+        if (len == 0)
+        {
+            if (t.state == TOK_URC)
+            {
+                // The rest of the URC never arrived
+                stats_urc(true);
+            }
+            return;
+        }
+        size_t pos = 0;
+        while (tok_feed(&t, (const char *)span + pos, len - pos, &used) != AT_MORE)
+        {
+            // A stray OK or ERROR, ie the end of a response that timed out
+            pos += used;
+            tok_init(&t, &no_fields);
         }
-        *c->len = atoi(rb->data + 2);
+        modem_read_finish(len);
     }
 }
 
-int atnsost_decode(int *sock_fd, size_t *sent)
+// Decode AT+NRB responses. It just waits for OK or ERROR with a slightly
+// longer timeout than the default commands.
+int atnrb_decode()
 {
-    struct nsost_ctx ctx = {
-        .sockfd = sock_fd,
-        .len = sent,
-    };
-    return decode_input(CMD_TIMEOUT, &ctx, NULL, nsost_eol);
+    return at_parse(CMD_REBOOT_TIMEOUT, NULL, NULL);
 }
 
-// Decode NSORF responses. Each field is decoded separately and stored off in
-// a temporary buffer (except the data field which might be large).
-#define FROM_HEX(x) (x - '0' > 9 ? x - 'A' + 10 : x - '0')
+// AT responses - wait for OK (ERROR is quite rare here but it is handled)
+#define at_decode() at_parse(CMD_TIMEOUT, NULL, NULL)
 
-#define MAX_FIELD_SIZE 16
+int atok_decode()
+{
+    return at_decode();
+}
 
-struct nsorf_ctx
+// Decode response for AT+NSOCL (close socket). There is no return from this
+// command, just OK or ERROR.
+int atnsocl_decode()
 {
-    int *sockfd;
-    char *ip;
-    int *port;
-    uint8_t *data;
-    size_t *remaining;
-    size_t *received;
-    int fieldno;
-    int fieldindex;
-    char field[MAX_FIELD_SIZE];
-    int dataidx;
-};
+    return at_decode();
+}
 
-void nsorf_eol(void *ctx, struct buf *rb, bool is_urc)
+// Decode the CGPADDR response: +CGPADDR: <cid>[,"<address>"]. The address is
+// missing until the PDP context is activated.
+int atcgpaddr_decode(char *address, size_t *len)
 {
-    struct nsorf_ctx *c = (struct nsorf_ctx *)ctx;
-    if (!is_urc && c->fieldindex > 0)
-    {
-        *c->remaining = atoi(c->field);
-    }
+    address[0] = 0;
+    *len = 0;
+    struct at_field fields[] = {
+        {AT_FIELD_SKIP},
+        {AT_FIELD_STR, address, AT_ADDRESS_SIZE, len},
+    };
+    struct at_schema schema = {
+        .prefix = "+CGPADDR:",
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
+    };
+    return at_parse(CMD_TIMEOUT, &schema, NULL);
 }
 
-void nsorf_char(void *ctx, struct buf *rb, char b, bool is_urc, bool is_space)
+// Decode NSOCR responses. This is fairly straightforward since there's only
+// a single number that is returned.
+int atnsocr_decode(int *sockfd)
 {
-    if (is_urc || is_space)
-    {
-        return;
-    }
-    struct nsorf_ctx *c = (struct nsorf_ctx *)ctx;
+    *sockfd = -2;
+    struct at_field fields[] = {
+        {AT_FIELD_INT, sockfd},
+    };
+    struct at_schema schema = {
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
+    };
+    return at_parse(CMD_TIMEOUT, &schema, NULL);
+}
 
-    switch (b)
+// Decode NSOST responses: <socket>,<length>
+int atnsost_decode(int *sock_fd, size_t *sent)
+{
+    int len = 0;
+    struct at_field fields[] = {
+        {AT_FIELD_INT, sock_fd},
+        {AT_FIELD_INT, &len},
+    };
+    struct at_schema schema = {
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
+    };
+    int ret = at_parse(CMD_TIMEOUT, &schema, NULL);
+    if (ret == AT_OK && *sock_fd >= 7)
     {
-    case ',':
-        c->fieldindex = 0;
-        switch (c->fieldno)
-        {
-        case 0:
-            *c->sockfd = atoi(c->field);
-            break;
-        case 1:
-            strcpy(c->ip, c->field);
-            break;
-        case 2:
-            *c->port = atoi(c->field);
-            break;
-        case 3:
-            // ignore
-            break;
-        case 4:
-            // ignore
-            break;
-        default:
-            // Should not encounter field #5 here
-            LOG_ERR("Too many fields (%d) in response\n", c->fieldno);
-            return;
-        }
-        memset(c->field, 0, MAX_FIELD_SIZE);
-        c->fieldno++;
-        break;
-    case '\"':
-        break;
-    default:
-        c->field[c->fieldindex++] = b;
-        if (c->fieldno == 4 && c->fieldindex == 2)
-        {
-            c->data[c->dataidx++] = (FROM_HEX(c->field[0]) << 4 | FROM_HEX(c->field[1]));
-            (*c->received)++;
-            c->fieldindex = 0;
-        }
-        break;
+        LOG_ERR("Socket fd should be <= 6 but is %d", *sock_fd);
     }
+    *sent = len;
+    return ret;
 }
 
+// Decode NSORF responses: <socket>,<ip>,<port>,<length>,<data>,<remaining>
+//
+// If AT+NSORF is sent before the +NSONMI URC the modem responds with just
+// <socket>,<data>,<remaining>. Both layouts are parsed and the number of
+// fields in the line decides which one is used.
 int atnsorf_decode(int *sockfd, char *ip, int *port, uint8_t *data, size_t *received, size_t *remaining)
 {
-    struct nsorf_ctx ctx = {
-        .sockfd = sockfd,
-        .ip = ip,
-        .port = port,
-        .data = data,
-        .remaining = remaining,
-        .fieldno = 0,
-        .fieldindex = 0,
-        .dataidx = 0,
-        .received = received,
+    int rem = 0, alt_rem = 0, length = 0;
+    size_t alt_received = 0;
+    int fieldcount = 0;
+    ip[0] = 0;
+    *port = 0;
+    *received = 0;
+    struct at_field short_fields[] = {
+        {AT_FIELD_INT, sockfd},
+        {AT_FIELD_HEX, data, AT_NSORF_MAX_DATA, &alt_received},
+        {AT_FIELD_INT, &alt_rem},
+    };
+    const struct at_schema short_schema = {
+        .fields = short_fields,
+        .count = ARRAY_SIZE(short_fields),
+    };
+    struct at_field fields[] = {
+        {AT_FIELD_INT, sockfd},
+        {AT_FIELD_STR, ip, AT_ADDRESS_SIZE},
+        {AT_FIELD_INT, port},
+        {AT_FIELD_INT, &length},
+        {AT_FIELD_HEX, data, AT_NSORF_MAX_DATA, received},
+        {AT_FIELD_INT, &rem},
     };
-    return decode_input(CMD_TIMEOUT, &ctx, nsorf_char, nsorf_eol);
+    struct at_schema schema = {
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
+        .alt = &short_schema,
+    };
+    int ret = at_parse(CMD_TIMEOUT, &schema, &fieldcount);
+    if (fieldcount == short_schema.count)
+    {
+        ip[0] = 0;
+        *port = 0;
+        *received = alt_received;
+        rem = alt_rem;
+    }
+    else if (!data)
+    {
+        // The data is discarded. Use the length field instead.
+        *received = length;
+    }
+    *remaining = rem;
+    return ret;
 }
 
 // Decode AT+CPSMS responses. This just waits for ERROR or OK
@@ -364,41 +805,55 @@ int atcpsms_decode()
     return at_decode();
 }
 
-
-// Decode AT+CIMI responses.
-struct cimi_ctx
+// Decode AT+CEDRXS responses. This just waits for ERROR or OK
+int atcedrxs_decode()
 {
-    char *imsi;
-    uint8_t index;
-    bool done;
-};
+    return at_decode();
+}
 
-void cimi_char(void *ctx, struct buf *rb, char b, bool is_urc, bool is_space)
+// Decode AT+CFUN? responses: +CFUN: <fun>
+int atcfun_decode(int *fun)
 {
-    struct cimi_ctx *c = (struct cimi_ctx *)ctx;
-    if (!c->done && !is_urc && !is_space)
-    {
-        struct cimi_ctx *c = (struct cimi_ctx *)ctx;
-        c->imsi[c->index++] = b;
-    }
+    *fun = -1;
+    struct at_field fields[] = {
+        {AT_FIELD_INT, fun},
+    };
+    struct at_schema schema = {
+        .prefix = "+CFUN:",
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
+    };
+    return at_parse(CMD_TIMEOUT, &schema, NULL);
 }
 
-void cimi_eol(void *ctx, struct buf *rb, bool is_urc)
+// Decode AT+CEREG? responses: +CEREG: <n>,<stat>[,<tac>,<ci>,<AcT>]
+int atcereg_decode(int *stat)
 {
-    struct cimi_ctx *c = (struct cimi_ctx *)ctx;
-    if (!c->done && c->index > 0)
-    {
-        c->imsi[c->index] = 0;
-        c->done = true;
-    }
+    *stat = -1;
+    struct at_field fields[] = {
+        {AT_FIELD_SKIP},
+        {AT_FIELD_INT, stat},
+    };
+    // The +CEREG: <stat> URC may arrive in the middle of the response
+    struct at_schema schema = {
+        .prefix = "+CEREG:",
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
+        .min_fields = ARRAY_SIZE(fields),
+    };
+    return at_parse(CMD_TIMEOUT, &schema, NULL);
 }
 
+// Decode AT+CIMI responses. The IMSI is the only line in the response.
 int atcimi_decode(char *imsi)
 {
-    struct cimi_ctx ctx = {
-        .imsi = imsi,
-        .index = 0,
-        .done = false,
+    imsi[0] = 0;
+    struct at_field fields[] = {
+        {AT_FIELD_STR, imsi, AT_IMSI_SIZE},
+    };
+    struct at_schema schema = {
+        .fields = fields,
+        .count = ARRAY_SIZE(fields),
     };
-    return decode_input(CMD_TIMEOUT, &ctx, cimi_char, cimi_eol);
-}
\ No newline at end of file
+    return at_parse(CMD_TIMEOUT, &schema, NULL);
+}
@@ -3,18 +3,103 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stddef.h>
 
 #define AT_OK 0
 #define AT_ERROR -1
 #define AT_TIMEOUT -2
 
+// Buffer sizes for the decoded fields
+#define AT_ADDRESS_SIZE 16
+#define AT_IMSI_SIZE 22
+#define AT_NSORF_MAX_DATA 512
+
+/**
+ * @brief Field types for response schemas
+ */
+enum at_field_type
+{
+    // Decimal integer with an optional minus sign, stored in an int. Other
+    // characters or a value that doesn't fit make the field invalid.
+    AT_FIELD_INT,
+    // String (quoted or not), NUL terminated and truncated to fit
+    AT_FIELD_STR,
+    // Hex encoded binary data, decoded into a byte buffer
+    AT_FIELD_HEX,
+    // Ignored
+    AT_FIELD_SKIP,
+};
+
+/**
+ * @brief A field in a response line. Fields with a NULL destination are
+ *        ignored.
+ */
+struct at_field
+{
+    enum at_field_type type;
+    void *dest;
+    // Size of the destination buffer for strings and hex data
+    size_t size;
+    // Optional. Set to the string length or the number of decoded bytes.
+    size_t *len;
+};
+
+/**
+ * @brief Layout of the response line for a command. Only the first line that
+ *        matches is decoded.
+ */
+struct at_schema
+{
+    // Prefix of the response line, ie "+CGPADDR:". NULL if the response is a
+    // plain line without a prefix.
+    const char *prefix;
+    const struct at_field *fields;
+    uint8_t count;
+    // Optional alternative layout. It is decoded in parallel and is the one
+    // to use if the line has exactly alt->count fields.
+    const struct at_schema *alt;
+    // Optional. Lines with the prefix and fewer fields than this are URCs
+    // that share the prefix with the response (ie +CEREG) and go to the
+    // URC dispatcher. The line must fit in a URC.
+    uint8_t min_fields;
+};
+
+/**
+ * @brief  Parse a command response with a single-pass tokenizer until OK or
+ *         ERROR is received. Lines starting with + that don't match the
+ *         schema prefix are URCs and are passed to the URC dispatcher.
+ *         Lines after the first one that match the prefix are skipped.
+ * @param  timeout: Time to wait for more input
+ * @param  *schema: Layout of the response line. NULL if the response is just
+ *         OK or ERROR.
+ * @param  *fields: Optional. Set to the number of fields in the decoded line.
+ * @return 0 for OK, -1 for ERROR (or +CME ERROR, or a response line with
+ *         fields that couldn't be decoded), -2 for timeout
+ */
+int at_parse(int32_t timeout, const struct at_schema *schema, int *fields);
+
+/**
+ * @brief  Handle input that arrives while no command is in progress. URCs
+ *         are dispatched and anything else is dropped. Returns when there's
+ *         no more input at the end of a line.
+ */
+void at_idle(void);
+
+/**
+ * @brief  Decode a response that is just OK or ERROR.
+ * @return 0 for OK, -1 for ERROR, -2 for timeout
+ * @note   Will swallow URCs and call the appropriate callbacks
+ */
+int atok_decode();
+
 /**
  * @brief  Decode AT+NSORF response. The buffer is read in multiple chunks from
  *         the modem.
- * @return -1 for ERROR response, -2 for timeout, number of bytes decoded otherwise
+ * @return -1 for ERROR response or a payload that isn't valid hex, -2 for
+ *         timeout, number of bytes decoded otherwise
  * @note   Will swallow URCs and call the appropriate callbacks. The lenght of
  *         the buffer must fit the number of bytes that is returned (it's set in
- *         the NSORF command)
+ *         the NSORF command). If data is NULL the payload is discarded.
  */
 int atnsorf_decode(int *sockfd, char *ip, int *port, uint8_t *data, size_t *received, size_t *remaining);
 
@@ -22,6 +107,7 @@ int atnsorf_decode(int *sockfd, char *ip, int *port, uint8_t *data, size_t *rece
  * @brief Decode AT+CGPADDR response.
  * @return  0 for OK, -1 for ERROR response, -2 for timeout, lenght of address string otherwise
  * @note Will swallow URCs and call appropriate callbacks.  Address might be "0"
+ *       The address buffer must have room for AT_ADDRESS_SIZE characters.
  */
 int atcgpaddr_decode(char *address, size_t *len);
 
@@ -55,13 +141,31 @@ int atnrb_decode();
 
 /**
  * @brief decode AT+CIMI response from modem
- * @note buffer should have enough room for IMSIs (22 chars)
+ * @note buffer should have enough room for IMSIs (AT_IMSI_SIZE chars)
  */
 int atcimi_decode(char *imsi);
 
+/**
+ * @brief decode AT+CFUN? response from modem.
+ * @param *fun: Set to the functionality level (1 is full functionality) or
+ *        -1 if it is missing
+ */
+int atcfun_decode(int *fun);
+
+/**
+ * @brief decode AT+CEREG? response from modem.
+ * @param *stat: Set to the registration status or -1 if it is missing
+ */
+int atcereg_decode(int *stat);
+
 /**
  * @brief decode AT+CPSMS response from modem.
  */
 int atcpsms_decode();
 
+/**
+ * @brief decode AT+CEDRXS response from modem.
+ */
+int atcedrxs_decode();
+
 
@@ -10,225 +10,1005 @@ LOG_MODULE_REGISTER(n2_comms);
 #include <uart.h>
 #include <kernel.h>
 #include <sys/ring_buffer.h>
+#include <sys/slist.h>
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include "comms.h"
 #include "at_commands.h"
+#include "hex.h"
+#include "urc.h"
+#include "stats.h"
+#include "trace.h"
+#include "replay.h"
 
-// Ring buffer for received data
+// Ring buffer for received data. Responses and URCs share it; the modem
+// thread splits them up when it parses the lines.
 #define RB_SIZE 128
 static u8_t buffer[RB_SIZE];
 static struct ring_buf rx_rb;
-static struct k_sem urc_sem;
-
-// Ring buffer for URCs. These are handled separately
-#define URC_SIZE 64
-static uint8_t urcbuffer[URC_SIZE];
-static struct ring_buf urc_rb;
 static struct k_sem rx_sem;
 
+#if CONFIG_N2_TRACE_SIZE > 0
+// Set when a command is written and cleared when the first bytes after it
+// arrive, so only the start of the response is traced from the interrupt
+static volatile bool trace_rx_first;
+#endif
 
-#define URC_THREAD_STACK 512
-#define URC_THREAD_PRIORITY (CONFIG_NUM_COOP_PRIORITIES)
 #define UART_NAME "UART_0"
 #define DUMP_MODEM 0
+// How often the address is checked while waiting for +CEREG
+#define ATTACH_CHECK_INTERVAL 30000
+// Number of AT probes before the modem is considered unresponsive
+#define PROBE_ATTEMPTS 3
+// How long to wait for the attach when the reboot was skipped. A modem that
+// answers the probe may still be wedged or denied registration, so it is
+// rebooted after all when this runs out.
+#define WARM_ATTACH_TIMEOUT 90000
+// Number of sockets on the modem
+#define MODEM_SOCKETS 7
+
+// AT command engine. Commands are queued by the callers and written and
+// decoded one at a time by the modem thread, so the callers don't have to
+// serialise access to the modem themselves. The modem thread is also the
+// only reader of the received data: URCs are dispatched from it, both while
+// a command is in progress and between commands.
+#define AT_THREAD_STACK 1536
+#define AT_THREAD_PRIORITY (CONFIG_NUM_COOP_PRIORITIES)
+
+static struct k_fifo at_queue;
 
-struct k_thread urc_thread;
+struct k_thread at_thread;
 
-K_THREAD_STACK_DEFINE(urc_thread_stack,
-                      URC_THREAD_STACK);
+K_THREAD_STACK_DEFINE(at_thread_stack,
+                      AT_THREAD_STACK);
+
+// Transmit pipeline. Outgoing data is staged in two chunk buffers. While one
+// chunk is clocked out by the UART (through EasyDMA on the UARTE) the writer
+// fills the other, so the hex encoding of a payload overlaps with the
+// transmission. The writer only blocks when both chunks are in flight.
+#define TX_CHUNK_SIZE 64
+
+struct tx_chunk
+{
+    uint8_t data[TX_CHUNK_SIZE];
+    size_t len;
+    size_t pos;
+    volatile bool ready;
+};
+
+static struct tx_chunk tx_chunks[2];
+// Chunk currently being filled by the writer
+static uint8_t tx_fill = 0;
+static bool tx_claimed = false;
+#if defined(CONFIG_UART_INTERRUPT_DRIVEN)
+#define TX_PIPELINED 1
+// Chunk currently on the wire. Only touched by the ISR.
+static uint8_t tx_wire = 0;
+static volatile bool tx_active = false;
+// Number of chunks available to the writer
+static struct k_sem tx_sem;
+#endif
+
+static struct device *uart_dev = NULL;
 
 static recv_callback_t recv_cb = NULL;
 
+// A thread in wait_state(). Each waiter polls on its own signal so no
+// waiter resets a signal that another one is about to poll on.
+struct state_waiter
+{
+    sys_snode_t node;
+    struct k_poll_signal signal;
+};
+
+// Radio state, updated from +CSCON and +NPSMR. The waiters are woken on
+// every change.
+static volatile enum modem_radio_state radio_state = MODEM_RADIO_IDLE;
+static sys_slist_t radio_waiters;
+static radio_callback_t radio_cb = NULL;
+
+// Network registration, updated from +CEREG. The waiters are also woken
+// when the bring-up completes.
+static volatile bool registered = false;
+static sys_slist_t reg_waiters;
+
+// Background bring-up of the modem
+#define BRINGUP_THREAD_STACK 1024
+#define BRINGUP_THREAD_PRIORITY (CONFIG_NUM_COOP_PRIORITIES)
+
+enum bringup_state
+{
+    BRINGUP_PROBE,
+    BRINGUP_RESTART,
+    BRINGUP_CONFIGURE,
+    BRINGUP_ATTACH,
+    BRINGUP_IDENTIFY,
+    BRINGUP_DONE,
+};
+
+struct k_thread bringup_thread;
+
+K_THREAD_STACK_DEFINE(bringup_thread_stack,
+                      BRINGUP_THREAD_STACK);
+
+static volatile bool bringup_done = false;
+static link_callback_t link_cb = NULL;
+
 void receive_callback(recv_callback_t receive_cb)
 {
     recv_cb = receive_cb;
 }
 
-void urc_threadproc(void)
+void radio_state_callback(radio_callback_t cb)
 {
-    char buf[URC_SIZE];
-    uint8_t index = 0;
-    uint8_t b = 0;
-    while (true)
+    radio_cb = cb;
+}
+
+void link_callback(link_callback_t cb)
+{
+    link_cb = cb;
+}
+
+/**
+ * @brief Wake all threads waiting for a state change. Called after the
+ *        state is updated.
+ */
+static void state_notify(sys_slist_t *waiters)
+{
+    struct state_waiter *w;
+    unsigned int key = irq_lock();
+    SYS_SLIST_FOR_EACH_CONTAINER(waiters, w, node)
     {
-        k_sem_take(&urc_sem, K_FOREVER);
-        if (ring_buf_get(&urc_rb, &b, 1) == 1)
-        {
-            if (b == '\r')
-            {
-                // this is a new URC
-                buf[index] = 0;
-                if (index > 0)
-                {
-                    if (recv_cb && strncmp(buf, "+NSONMI:", 8) == 0)
-                    {
-                        // This is a receive notification. Invoke callback
-                        char *countptr = NULL;
-                        char *fdptr = buf;
-                        for (uint8_t i = 0; i < index; i++)
-                        {
-                            if (buf[i] == ',')
-                            {
-                                countptr = (buf + i + 1);
-                                buf[i] = 0;
-                            }
-                        }
-                        // Note offset -- this is the "+NSONMI: " prefix
-                        recv_cb(atoi(fdptr + 9), atoi(countptr));
-                    }
-                }
-                index = 0;
-            }
-            if (b != '\r' && b != '\n')
-            {
-                buf[index++] = b;
-            }
-        }
+        k_poll_signal_raise(&w->signal, 0);
+    }
+    irq_unlock(key);
+}
+
+static void radio_update(enum modem_radio_state state)
+{
+    if (state == radio_state)
+    {
+        return;
+    }
+    LOG_DBG("Radio state %d -> %d", radio_state, state);
+    radio_state = state;
+    state_notify(&radio_waiters);
+    if (radio_cb)
+    {
+        radio_cb(state);
+    }
+}
+
+/**
+ * @brief Radio state URCs. +CSCON is the RRC connection and +NPSMR is the
+ *        power saving mode. The modem leaves PSM (+NPSMR: 0) before it
+ *        connects and enters PSM some time after it has gone idle.
+ */
+static void cscon_urc(const union urc_arg *args, int count, void *ctx)
+{
+    if (count < 1)
+    {
+        return;
+    }
+    if (args[0].i == 1)
+    {
+        radio_update(MODEM_RADIO_CONNECTED);
+    }
+    else if (radio_state != MODEM_RADIO_PSM)
+    {
+        radio_update(MODEM_RADIO_IDLE);
     }
 }
+
+static void npsmr_urc(const union urc_arg *args, int count, void *ctx)
+{
+    if (count < 1)
+    {
+        return;
+    }
+    radio_update(args[0].i == 1 ? MODEM_RADIO_PSM : MODEM_RADIO_IDLE);
+}
+
+// +NSONMI: <socket>,<length>
+static void nsonmi_urc(const union urc_arg *args, int count, void *ctx)
+{
+    if (recv_cb && count == 2)
+    {
+        recv_cb(args[0].i, args[1].i);
+    }
+}
+
+// Registration status from +CEREG or AT+CEREG?. Home (1) and roaming (5)
+// are registered. Runs on the modem thread.
+static void registration_update(int stat)
+{
+    bool now = (stat == 1 || stat == 5);
+    if (now != registered)
+    {
+        LOG_INF("Network registration: %d", stat);
+        registered = now;
+        state_notify(&reg_waiters);
+    }
+}
+
+// +CEREG: <stat>[,<tac>,<ci>,<AcT>]
+static void cereg_urc(const union urc_arg *args, int count, void *ctx)
+{
+    if (count < 1)
+    {
+        return;
+    }
+    registration_update(args[0].i);
+}
+
+static struct urc_handler cereg_handler = {
+    .name = "+CEREG",
+    .format = "i",
+    .callback = cereg_urc,
+};
+
+static struct urc_handler nsonmi_handler = {
+    .name = "+NSONMI",
+    .format = "ii",
+    .callback = nsonmi_urc,
+};
+
+static struct urc_handler cscon_handler = {
+    .name = "+CSCON",
+    .format = "i",
+    .callback = cscon_urc,
+};
+
+// +UFOTAS: <blocks remaining>,<status> reports progress of a modem firmware
+// update
+static void ufotas_urc(const union urc_arg *args, int count, void *ctx)
+{
+    if (count == 2)
+    {
+        LOG_INF("Modem firmware update: %d blocks remaining, status %d", args[0].i, args[1].i);
+    }
+}
+
+static struct urc_handler ufotas_handler = {
+    .name = "+UFOTAS",
+    .format = "ii",
+    .callback = ufotas_urc,
+};
+
+static struct urc_handler npsmr_handler = {
+    .name = "+NPSMR",
+    .format = "i",
+    .callback = npsmr_urc,
+};
+
 /*
  * Modem comms. It's quite a mechanism - the UART is read from an ISR, then
- * sent to a processing thread via a ring buffer. The processing thread
- * parses the incoming data stream and when OK or ERROR is received the
- * data is forwarded to the consuming library via modem_read_line.
+ * sent to the modem thread via a ring buffer. The modem thread parses the
+ * incoming data stream one line at a time: response lines are decoded for
+ * the command in progress and URCs are dispatched to their handlers.
+ */
+
+/**
+ * @brief Put a burst of received bytes in the RX ring buffer. The modem
+ *        thread is signalled once per burst rather than once per byte.
+ */
+static void rx_burst(const uint8_t *data, size_t len)
+{
+#if DUMP_MODEM
+    for (size_t i = 0; i < len; i++)
+    {
+        printk("%c", data[i]);
+    }
+#endif
+#if CONFIG_N2_TRACE_SIZE > 0
+    if (trace_rx_first)
+    {
+        trace_rx_first = false;
+        trace_put(TRACE_RX_FIRST, len, NULL, 0);
+    }
+#endif
+    u32_t written = ring_buf_put(&rx_rb, data, len);
+    stats_rx(len, len - written);
+    if (written < len)
+    {
+        LOG_ERR("RX buffer is full. Bytes pending: %d, written: %d", len, written);
+    }
+    if (written > 0)
+    {
+        k_sem_give(&rx_sem);
+    }
+}
+
+#if defined(CONFIG_UART_INTERRUPT_DRIVEN)
+/**
+ * @brief Feed the UART from the chunk on the wire. When the chunk is sent
+ *        it is handed back to the writer and the ISR moves on to the next
+ *        one. TX interrupts are disabled when there's nothing left to send.
  */
+static void tx_isr(struct device *dev)
+{
+    struct tx_chunk *c = &tx_chunks[tx_wire];
+    if (!c->ready)
+    {
+        uart_irq_tx_disable(dev);
+        tx_active = false;
+        return;
+    }
+    c->pos += uart_fifo_fill(dev, c->data + c->pos, c->len - c->pos);
+    if (c->pos == c->len)
+    {
+        c->ready = false;
+        tx_wire ^= 1;
+        k_sem_give(&tx_sem);
+    }
+}
+
+#define RX_BURST_SIZE 32
 
 /**
- * @brief The ISR for UART rx
+ * @brief The ISR for the UART. The RX FIFO is drained completely on each
+ *        interrupt and handed over as a single burst.
  */
 static void uart_isr(void *user_data)
 {
-    static char prev = '\n';
-    static bool in_urc = false;
     struct device *dev = (struct device *)user_data;
-    uint8_t data;
-    int rx, rb;
+    uint8_t burst[RX_BURST_SIZE];
+    int len = 0;
+    int rx;
     while (uart_irq_update(dev) &&
-           uart_irq_rx_ready(dev))
+           uart_irq_is_pending(dev))
     {
-        rx = uart_fifo_read(dev, &data, 1);
-        if (rx == 0)
+        if (uart_irq_rx_ready(dev))
         {
-            return;
+            while ((rx = uart_fifo_read(dev, burst + len, RX_BURST_SIZE - len)) > 0)
+            {
+                len += rx;
+                if (len == RX_BURST_SIZE)
+                {
+                    rx_burst(burst, len);
+                    len = 0;
+                }
+            }
         }
-#if DUMP_MODEM
-        printk("%c", data);
-#endif
-        if (prev == '\n' && data == '+')
+        if (uart_irq_tx_ready(dev))
         {
-            in_urc = true;
+            tx_isr(dev);
         }
-        if (in_urc)
+    }
+    if (len > 0)
+    {
+        rx_burst(burst, len);
+    }
+}
+#else
+/*
+ * Polled RX for UART drivers without interrupt support (ie the native_posix
+ * pseudo terminal). The thread drains whatever is available and then sleeps
+ * for a tick.
+ */
+#define RX_POLL_THREAD_STACK 512
+#define RX_POLL_THREAD_PRIORITY (CONFIG_NUM_COOP_PRIORITIES - 1)
+#define RX_BURST_SIZE 32
+
+struct k_thread rx_poll_thread;
+
+K_THREAD_STACK_DEFINE(rx_poll_thread_stack,
+                      RX_POLL_THREAD_STACK);
+
+void rx_poll_threadproc(void *dev, void *p2, void *p3)
+{
+    uint8_t burst[RX_BURST_SIZE];
+    int len = 0;
+    while (true)
+    {
+        while (len < RX_BURST_SIZE && uart_poll_in((struct device *)dev, &burst[len]) == 0)
         {
-            ring_buf_put(&urc_rb, &data, 1);
-            k_sem_give(&urc_sem);
+            len++;
         }
-        if (in_urc && data == '\r')
+        if (len > 0)
         {
-            in_urc = false;
+            rx_burst(burst, len);
         }
-        rb = ring_buf_put(&rx_rb, &data, 1);
-        if (rb != rx)
+        if (len < RX_BURST_SIZE)
         {
-            LOG_ERR("RX buffer is full. Bytes pending: %d, written: %d", rx, rb);
-            return;
+            k_sleep(1);
         }
-        prev = data;
-        k_sem_give(&rx_sem);
+        len = 0;
     }
 }
+#endif
 
-void modem_write(const char *cmd)
+/**
+ * @brief Get the chunk the writer should fill, waiting for one to become
+ *        available if both are in flight.
+ */
+static struct tx_chunk *tx_claim(void)
+{
+    struct tx_chunk *c = &tx_chunks[tx_fill];
+    if (!tx_claimed)
+    {
+#if defined(TX_PIPELINED)
+        k_sem_take(&tx_sem, K_FOREVER);
+#endif
+        c->len = 0;
+        c->pos = 0;
+        tx_claimed = true;
+    }
+    return c;
+}
+
+/**
+ * @brief Hand the chunk being filled over to the UART.
+ */
+static void tx_commit(void)
 {
+    struct tx_chunk *c = &tx_chunks[tx_fill];
+    if (!tx_claimed || c->len == 0)
+    {
+        return;
+    }
 #if DUMP_MODEM
-    printk("%s", cmd);
+    for (size_t i = 0; i < c->len; i++)
+    {
+        printk("%c", c->data[i]);
+    }
 #endif
-    struct device *uart_dev = device_get_binding(UART_NAME);
-	if (!uart_dev) {
-		LOG_ERR("Cannot get UART device");
-		return;
-	}
+    tx_claimed = false;
+    tx_fill ^= 1;
+#if defined(TX_PIPELINED)
+    c->ready = true;
+    unsigned int key = irq_lock();
+    if (!tx_active)
+    {
+        tx_active = true;
+        uart_irq_tx_enable(uart_dev);
+    }
+    irq_unlock(key);
+#else
+    for (size_t i = 0; i < c->len; i++)
+    {
+        uart_poll_out(uart_dev, c->data[i]);
+    }
+#endif
+}
+
+static void tx_put(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        struct tx_chunk *c = tx_claim();
+        size_t n = MIN(len, TX_CHUNK_SIZE - c->len);
+        memcpy(c->data + c->len, data, n);
+        c->len += n;
+        data += n;
+        len -= n;
+        if (c->len == TX_CHUNK_SIZE)
+        {
+            tx_commit();
+        }
+    }
+}
+
+static void tx_put_hex(const uint8_t *data, size_t len)
+{
+    while (len > 0)
+    {
+        struct tx_chunk *c = tx_claim();
+        size_t n = MIN(len, (TX_CHUNK_SIZE - c->len) / 2);
+        c->len += hex_encode(data, n, (char *)c->data + c->len);
+        data += n;
+        len -= n;
+        if (c->len > TX_CHUNK_SIZE - 2)
+        {
+            tx_commit();
+        }
+    }
+}
+
+void modem_write(const char *cmd)
+{
+    if (!CONFIG_N2_REPLAY && !uart_dev)
+    {
+        LOG_ERR("Cannot get UART device");
+        return;
+    }
+    size_t len = strlen(cmd);
+#if CONFIG_N2_TRACE_SIZE > 0
+    trace_put(TRACE_TX, 0, cmd, len);
+    trace_rx_first = true;
+#endif
+    if (CONFIG_N2_REPLAY)
+    {
+        replay_write(cmd, NULL, 0, NULL);
+    }
+    else
+    {
+        tx_put((const uint8_t *)cmd, len);
+        tx_commit();
+    }
+    stats_tx(len);
+}
+
+void modem_write_hex(const char *prefix, const uint8_t *data, size_t len, const char *suffix)
+{
+    if (!CONFIG_N2_REPLAY && !uart_dev)
+    {
+        LOG_ERR("Cannot get UART device");
+        return;
+    }
+    size_t prefix_len = strlen(prefix);
+    size_t suffix_len = strlen(suffix);
+#if CONFIG_N2_TRACE_SIZE > 0
+    trace_put(TRACE_TX, len, prefix, prefix_len);
+    trace_rx_first = true;
+#endif
+    if (CONFIG_N2_REPLAY)
+    {
+        replay_write(prefix, data, len, suffix);
+    }
+    else
+    {
+        tx_put((const uint8_t *)prefix, prefix_len);
+        tx_put_hex(data, len);
+        tx_put((const uint8_t *)suffix, suffix_len);
+        tx_commit();
+    }
+    stats_tx(prefix_len + 2 * len + suffix_len);
+}
 
-    for (int i = 0; i < strlen(cmd); i++)
+size_t modem_read_claim(uint8_t **data, size_t max, int32_t timeout)
+{
+    if (CONFIG_N2_REPLAY)
     {
-        uart_poll_out(uart_dev, (unsigned char)cmd[i]);
+        return replay_read_claim(data, max);
     }
+    // The semaphore is given once per burst so it only says that there
+    // might be something in the buffer.
+    u32_t len;
+    while ((len = ring_buf_get_claim(&rx_rb, data, max)) == 0)
+    {
+        if (k_sem_take(&rx_sem, timeout) != 0)
+        {
+            return 0;
+        }
+    }
+    return len;
 }
 
-bool modem_read(uint8_t *b, int32_t timeout)
+void modem_read_finish(size_t len)
 {
-    switch (k_sem_take(&rx_sem, timeout))
+    if (CONFIG_N2_REPLAY)
     {
-    case 0:
-        if (ring_buf_get(&rx_rb, b, 1) == 1)
+        replay_read_finish(len);
+        return;
+    }
+    ring_buf_get_finish(&rx_rb, len);
+}
+
+void at_threadproc(void)
+{
+    struct k_poll_event events[] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_FIFO_DATA_AVAILABLE,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &at_queue),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE,
+                                 K_POLL_MODE_NOTIFY_ONLY,
+                                 &rx_sem),
+    };
+    while (true)
+    {
+        // Dispatch URCs that arrived since the last command. This returns at
+        // the end of a line so the next command starts on a fresh one.
+        at_idle();
+        struct at_cmd *cmd = k_fifo_get(&at_queue, K_NO_WAIT);
+        if (CONFIG_N2_REPLAY)
+        {
+            // Lets replay_finish() wait for the output after the last
+            // command to be read
+            replay_thread_state(cmd == NULL);
+        }
+        if (!cmd)
+        {
+            // Wait for a command or more input
+            events[0].state = K_POLL_STATE_NOT_READY;
+            events[1].state = K_POLL_STATE_NOT_READY;
+            k_poll(events, ARRAY_SIZE(events), K_FOREVER);
+            continue;
+        }
+        u32_t start = k_uptime_get_32();
+        if (radio_state != MODEM_RADIO_CONNECTED)
+        {
+            // A send now sets up a connection first (and leaves PSM). This
+            // is what the application should batch its traffic to avoid.
+            stats_wakeup(cmd->cmd);
+        }
+        if (cmd->payload)
+        {
+            modem_write_hex(cmd->cmd, cmd->payload, cmd->payload_len, cmd->suffix);
+        }
+        else
+        {
+            modem_write(cmd->cmd);
+        }
+        cmd->result = cmd->decode ? cmd->decode(cmd) : atok_decode();
+        stats_cmd(cmd->cmd, cmd->result, k_uptime_get_32() - start);
+        trace_put(TRACE_DONE, cmd->result, NULL, 0);
+        if (cmd->done)
+        {
+            cmd->done(cmd);
+            continue;
+        }
+        k_sem_give(&cmd->complete);
+    }
+}
+
+void modem_submit(struct at_cmd *cmd, at_done_t done)
+{
+    cmd->done = done;
+    k_fifo_put(&at_queue, cmd);
+}
+
+int modem_exec(struct at_cmd *cmd)
+{
+    k_sem_init(&cmd->complete, 0, 1);
+    modem_submit(cmd, NULL);
+    k_sem_take(&cmd->complete, K_FOREVER);
+    return cmd->result;
+}
+
+struct cgpaddr_result
+{
+    char ip[20];
+    size_t len;
+};
+
+static int cgpaddr_decode(struct at_cmd *cmd)
+{
+    struct cgpaddr_result *r = (struct cgpaddr_result *)cmd->ctx;
+    return atcgpaddr_decode(r->ip, &r->len);
+}
+
+bool modem_is_ready()
+{
+    struct cgpaddr_result res = {
+        .len = 0,
+    };
+    struct at_cmd cmd = {
+        .cmd = "AT+CGPADDR\r\n",
+        .decode = cgpaddr_decode,
+        .ctx = &res,
+    };
+    if (modem_exec(&cmd) == AT_OK)
+    {
+        if (res.len > 1)
         {
             return true;
         }
-        break;
-    default:
-        break;
     }
     return false;
 }
 
-bool modem_is_ready()
+static int nrb_decode(struct at_cmd *cmd)
+{
+    return atnrb_decode();
+}
+
+static int cpsms_decode(struct at_cmd *cmd)
+{
+    return atcpsms_decode();
+}
+
+static int cedrxs_decode(struct at_cmd *cmd)
 {
-    modem_write("AT+CGPADDR\r\n");
-    char ip[16];
-    size_t len = 0;
-    if (atcgpaddr_decode((char *)&ip, &len) == AT_OK)
+    return atcedrxs_decode();
+}
+
+// Units for the GPRS timers in 3GPP TS 24.008. The timer value is 5 bits
+// multiplied by the unit.
+struct timer_unit
+{
+    uint32_t seconds;
+    const char *bits;
+};
+
+// T3412 extended (GPRS timer 3)
+static const struct timer_unit tau_units[] = {
+    {2, "011"},
+    {30, "100"},
+    {60, "101"},
+    {600, "000"},
+    {3600, "001"},
+    {36000, "010"},
+    {1152000, "110"},
+};
+
+// T3324 (GPRS timer 2)
+static const struct timer_unit active_units[] = {
+    {2, "000"},
+    {60, "001"},
+    {360, "010"},
+};
+
+/**
+ * @brief Encode a timer as the 8 bit string used by AT+CPSMS, using the
+ *        finest unit that can express it.
+ * @return false if the timer is out of range
+ */
+static bool encode_timer(uint32_t seconds, const struct timer_unit *units, size_t count, char *out)
+{
+    for (size_t i = 0; i < count; i++)
     {
-        if (len > 1)
+        uint32_t value = (seconds + units[i].seconds - 1) / units[i].seconds;
+        if (value <= 31)
         {
+            memcpy(out, units[i].bits, 3);
+            for (int bit = 0; bit < 5; bit++)
+            {
+                out[3 + bit] = (value & (0x10 >> bit)) ? '1' : '0';
+            }
+            out[8] = 0;
             return true;
         }
     }
     return false;
 }
 
-void modem_restart()
+int modem_set_psm(bool enable, uint32_t periodic_tau, uint32_t active_time)
 {
-    modem_write("AT+NRB\r\n");
-    atnrb_decode();
+    char cmdbuf[40] = "AT+CPSMS=0\r";
+    if (enable)
+    {
+        char tau[9];
+        char active[9];
+        if (!encode_timer(periodic_tau, tau_units, ARRAY_SIZE(tau_units), tau) ||
+            !encode_timer(active_time, active_units, ARRAY_SIZE(active_units), active))
+        {
+            return -EINVAL;
+        }
+        sprintf(cmdbuf, "AT+CPSMS=1,,,\"%s\",\"%s\"\r", tau, active);
+    }
+    struct at_cmd cmd = {
+        .cmd = cmdbuf,
+        .decode = cpsms_decode,
+    };
+    return modem_exec(&cmd);
 }
 
-void modem_init(void)
+int modem_set_edrx(bool enable, uint8_t edrx)
 {
-    k_sem_init(&rx_sem, 0, RB_SIZE);
-    ring_buf_init(&rx_rb, RB_SIZE, buffer);
-    k_sem_init(&urc_sem, 0, URC_SIZE);
-    ring_buf_init(&urc_rb, URC_SIZE, urcbuffer);
+    if (edrx > 15)
+    {
+        return -EINVAL;
+    }
+    char cmdbuf[32] = "AT+CEDRXS=0\r";
+    if (enable)
+    {
+        // Access technology 5 is NB-IoT
+        sprintf(cmdbuf, "AT+CEDRXS=1,5,\"%d%d%d%d\"\r",
+                (edrx >> 3) & 1, (edrx >> 2) & 1, (edrx >> 1) & 1, edrx & 1);
+    }
+    struct at_cmd cmd = {
+        .cmd = cmdbuf,
+        .decode = cedrxs_decode,
+    };
+    return modem_exec(&cmd);
+}
 
-    k_thread_create(&urc_thread, urc_thread_stack,
-                    K_THREAD_STACK_SIZEOF(urc_thread_stack),
-                    (k_thread_entry_t)urc_threadproc,
-                    NULL, NULL, NULL, K_PRIO_COOP(URC_THREAD_PRIORITY), 0, K_NO_WAIT);
+enum modem_radio_state modem_radio_state(void)
+{
+    return radio_state;
+}
 
+/**
+ * @brief Wait until a condition holds, waking up when state_notify() is
+ *        called for the waiter list.
+ * @return 0 when the condition holds, -EAGAIN on timeout
+ */
+static int wait_state(sys_slist_t *waiters, bool (*cond)(int), int arg, int32_t timeout)
+{
+    struct state_waiter w;
+    k_poll_signal_init(&w.signal);
+    struct k_poll_event event = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+                                                         K_POLL_MODE_NOTIFY_ONLY,
+                                                         &w.signal);
+    unsigned int key = irq_lock();
+    sys_slist_append(waiters, &w.node);
+    irq_unlock(key);
 
-    struct device *uart_dev = device_get_binding(UART_NAME);
-    if (!uart_dev)
+    s64_t start = k_uptime_get();
+    int32_t remaining = timeout;
+    int ret;
+    while (true)
     {
-        LOG_ERR("Unable to load UART device\n");
-        return;
+        // Reset before checking so a change after the check isn't lost
+        k_poll_signal_reset(&w.signal);
+        event.state = K_POLL_STATE_NOT_READY;
+        if (cond(arg))
+        {
+            ret = 0;
+            break;
+        }
+        if (k_poll(&event, 1, remaining) != 0)
+        {
+            ret = -EAGAIN;
+            break;
+        }
+        if (timeout != K_FOREVER)
+        {
+            remaining = MAX(0, timeout - (int32_t)(k_uptime_get() - start));
+        }
     }
 
-    uart_irq_callback_user_data_set(uart_dev, uart_isr, uart_dev);
-    uart_irq_rx_enable(uart_dev);
+    key = irq_lock();
+    sys_slist_find_and_remove(waiters, &w.node);
+    irq_unlock(key);
+    return ret;
+}
+
+static bool radio_is(int state)
+{
+    return radio_state == state;
+}
+
+int modem_wait_radio(enum modem_radio_state state, int32_t timeout)
+{
+    return wait_state(&radio_waiters, radio_is, state, timeout);
+}
 
-    // Set up the modem. Might also include AT+CGPADDR to set up PDP context
-    // here.
-    modem_restart();
+static bool is_registered(int unused)
+{
+    return registered;
+}
+
+bool modem_is_registered(void)
+{
+    return registered;
+}
+
+int modem_wait_attach(int32_t timeout)
+{
+    return wait_state(&reg_waiters, is_registered, 0, timeout);
+}
+
+static bool is_link_up(int unused)
+{
+    return bringup_done && registered;
+}
+
+bool modem_link_up(void)
+{
+    return is_link_up(0);
+}
+
+int modem_wait_link(int32_t timeout)
+{
+    return wait_state(&reg_waiters, is_link_up, 0, timeout);
+}
+
+void modem_restart()
+{
+    struct at_cmd cmd = {
+        .cmd = "AT+NRB\r\n",
+        .decode = nrb_decode,
+    };
+    modem_exec(&cmd);
+}
+
+static int cfun_decode(struct at_cmd *cmd)
+{
+    return atcfun_decode((int *)cmd->ctx);
+}
+
+static int cereg_decode(struct at_cmd *cmd)
+{
+    int stat = -1;
+    int ret = atcereg_decode(&stat);
+    if (ret == AT_OK && stat >= 0)
+    {
+        registration_update(stat);
+    }
+    return ret;
+}
+
+/**
+ * @brief Check if the modem can be used without a reboot, ie it responds to
+ *        AT and is at full functionality. This is the case after an MCU-only
+ *        reset or a firmware update of the application.
+ */
+static bool modem_probe(void)
+{
+    struct at_cmd at = {
+        .cmd = "AT\r",
+    };
+    int attempt = 0;
+    // The first command may be garbled if the UART was reset halfway through
+    // a line.
+    while (modem_exec(&at) != AT_OK)
+    {
+        if (++attempt == PROBE_ATTEMPTS)
+        {
+            LOG_INF("Modem isn't responding");
+            return false;
+        }
+    }
+    int fun = -1;
+    struct at_cmd cfun = {
+        .cmd = "AT+CFUN?\r",
+        .decode = cfun_decode,
+        .ctx = &fun,
+    };
+    if (modem_exec(&cfun) != AT_OK || fun != 1)
+    {
+        LOG_INF("Modem functionality is %d", fun);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Close sockets left open on the modem by a previous run. There's no
+ *        command to list them so all of them are closed. ERROR just means
+ *        the socket wasn't open.
+ */
+static void modem_close_stale(void)
+{
+    char cmdbuf[16];
+    for (int i = 0; i < MODEM_SOCKETS; i++)
+    {
+        sprintf(cmdbuf, "AT+NSOCL=%d\r", i);
+        struct at_cmd cmd = {
+            .cmd = cmdbuf,
+        };
+        if (modem_exec(&cmd) == AT_OK)
+        {
+            LOG_INF("Closed stale socket %d", i);
+        }
+    }
+}
 
-    LOG_INF("Waiting for modem to connect...");
-    while (!modem_is_ready())
+static int cimi_decode(struct at_cmd *cmd)
+{
+    return atcimi_decode((char *)cmd->ctx);
+}
+
+/**
+ * @brief Enable the URCs the driver tracks. Registration is reported with
+ *        +CEREG; the query picks up the current state in case the modem
+ *        registered before reporting was turned on.
+ */
+static void modem_configure(void)
+{
+    static const char *const cmds[] = {
+        // Radio state changes
+        "AT+CSCON=1\r",
+        "AT+NPSMR=1\r",
+        // Registration changes
+        "AT+CEREG=1\r",
+    };
+    for (size_t i = 0; i < ARRAY_SIZE(cmds); i++)
     {
-        k_sleep(K_MSEC(2000));
+        struct at_cmd cmd = {
+            .cmd = cmds[i],
+        };
+        modem_exec(&cmd);
     }
-    modem_write("AT+CIMI\r");
+    struct at_cmd cereg = {
+        .cmd = "AT+CEREG?\r",
+        .decode = cereg_decode,
+    };
+    modem_exec(&cereg);
+}
+
+static void modem_identify(void)
+{
     char imsi[24];
-    if (atcimi_decode((char *)&imsi) != AT_OK)
+    struct at_cmd cmd = {
+        .cmd = "AT+CIMI\r",
+        .decode = cimi_decode,
+        .ctx = imsi,
+    };
+    if (modem_exec(&cmd) != AT_OK)
     {
         LOG_ERR("Unable to retrieve IMSI from modem");
     }
@@ -237,3 +1017,128 @@ void modem_init(void)
         LOG_INF("IMSI for modem is %s", log_strdup(imsi));
     }
 }
+
+void bringup_threadproc(void)
+{
+    enum bringup_state state = BRINGUP_PROBE;
+    // Set when the reboot was skipped
+    bool warm = false;
+    s64_t attach_start = 0;
+    while (state != BRINGUP_DONE)
+    {
+        switch (state)
+        {
+        case BRINGUP_PROBE:
+            // Skip the reboot if the modem is already up. The attach state
+            // picks up the registration and the address if it is attached.
+            if (!modem_probe())
+            {
+                state = BRINGUP_RESTART;
+                break;
+            }
+            LOG_INF("Modem is up, skipping restart");
+            modem_close_stale();
+            warm = true;
+            state = BRINGUP_CONFIGURE;
+            break;
+        case BRINGUP_RESTART:
+            registered = false;
+            warm = false;
+            modem_restart();
+            state = BRINGUP_CONFIGURE;
+            break;
+        case BRINGUP_CONFIGURE:
+            modem_configure();
+            LOG_INF("Waiting for modem to connect...");
+            attach_start = k_uptime_get();
+            state = BRINGUP_ATTACH;
+            break;
+        case BRINGUP_ATTACH:
+            // The IP address is assigned when the modem attaches. The
+            // timeout is a safety net for a lost URC.
+            modem_wait_attach(K_MSEC(ATTACH_CHECK_INTERVAL));
+            if (modem_is_ready())
+            {
+                state = BRINGUP_IDENTIFY;
+            }
+            else if (warm && k_uptime_get() - attach_start >= WARM_ATTACH_TIMEOUT)
+            {
+                LOG_WRN("Modem didn't attach, restarting it");
+                state = BRINGUP_RESTART;
+            }
+            else if (modem_is_registered())
+            {
+                // Registered but no address yet
+                k_sleep(K_MSEC(500));
+            }
+            break;
+        case BRINGUP_IDENTIFY:
+            modem_identify();
+            state = BRINGUP_DONE;
+            break;
+        default:
+            break;
+        }
+    }
+    bringup_done = true;
+    state_notify(&reg_waiters);
+    LOG_INF("Modem link is up");
+    if (link_cb)
+    {
+        link_cb();
+    }
+}
+
+void modem_init(void)
+{
+    k_sem_init(&rx_sem, 0, 1);
+    ring_buf_init(&rx_rb, RB_SIZE, buffer);
+
+    k_fifo_init(&at_queue);
+    sys_slist_init(&radio_waiters);
+    sys_slist_init(&reg_waiters);
+    urc_register(&cereg_handler);
+    urc_register(&nsonmi_handler);
+    urc_register(&cscon_handler);
+    urc_register(&npsmr_handler);
+    urc_register(&ufotas_handler);
+
+    k_thread_create(&at_thread, at_thread_stack,
+                    K_THREAD_STACK_SIZEOF(at_thread_stack),
+                    (k_thread_entry_t)at_threadproc,
+                    NULL, NULL, NULL, K_PRIO_COOP(AT_THREAD_PRIORITY), 0, K_NO_WAIT);
+
+    if (CONFIG_N2_REPLAY)
+    {
+        // No modem. The output comes from replay_start() and the commands
+        // from the replay tests.
+        return;
+    }
+
+    uart_dev = device_get_binding(UART_NAME);
+    if (!uart_dev)
+    {
+        LOG_ERR("Unable to load UART device\n");
+        return;
+    }
+
+#if defined(TX_PIPELINED)
+    k_sem_init(&tx_sem, 2, 2);
+#endif
+#if defined(CONFIG_UART_INTERRUPT_DRIVEN)
+    uart_irq_callback_user_data_set(uart_dev, uart_isr, uart_dev);
+    uart_irq_rx_enable(uart_dev);
+#else
+    k_thread_create(&rx_poll_thread, rx_poll_thread_stack,
+                    K_THREAD_STACK_SIZEOF(rx_poll_thread_stack),
+                    (k_thread_entry_t)rx_poll_threadproc,
+                    uart_dev, NULL, NULL, K_PRIO_COOP(RX_POLL_THREAD_PRIORITY), 0, K_NO_WAIT);
+#endif
+
+    // The modem is restarted and attached in the background so the rest of
+    // the system doesn't wait for it.
+    k_thread_create(&bringup_thread, bringup_thread_stack,
+                    K_THREAD_STACK_SIZEOF(bringup_thread_stack),
+                    (k_thread_entry_t)bringup_threadproc,
+                    NULL, NULL, NULL, K_PRIO_COOP(BRINGUP_THREAD_PRIORITY), 0, K_NO_WAIT);
+}
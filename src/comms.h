@@ -1,5 +1,7 @@
 #pragma once
 
+#include <zephyr.h>
+
 #define UART_COMMS 1
 //#define I2C_COMMS 1
 
@@ -8,6 +10,86 @@
  */
 typedef void (*recv_callback_t)(int fd, size_t bytes);
 
+/**
+ * @brief Radio state as reported by the +CSCON and +NPSMR URCs.
+ */
+enum modem_radio_state
+{
+    // RRC connected. Data is sent and received right away.
+    MODEM_RADIO_CONNECTED,
+    // RRC idle. Sending sets up a new connection. Downlink data is only
+    // received at paging occasions.
+    MODEM_RADIO_IDLE,
+    // Power saving mode. The modem can't be reached until it sends data
+    // or the periodic TAU timer expires.
+    MODEM_RADIO_PSM,
+};
+
+/**
+ * @brief Callback for radio state changes. Runs on the modem thread so it
+ *        must not wait for an AT command (modem_submit() is fine).
+ */
+typedef void (*radio_callback_t)(enum modem_radio_state state);
+
+/**
+ * @brief Callback for when the modem link comes up after the bring-up.
+ *        Runs on the bring-up thread and may issue AT commands.
+ */
+typedef void (*link_callback_t)(void);
+
+struct at_cmd;
+
+/**
+ * @brief Response decoder for a queued AT command. Runs on the modem thread.
+ * @return AT_OK, AT_ERROR or AT_TIMEOUT
+ */
+typedef int (*at_decode_t)(struct at_cmd *cmd);
+
+/**
+ * @brief Completion callback for a queued AT command. Runs on the modem thread
+ *        when the response is decoded. The command may be reused or released
+ *        from the callback.
+ */
+typedef void (*at_done_t)(struct at_cmd *cmd);
+
+/**
+ * @brief An AT command queued for the modem thread. The command and any
+ *        buffers it refers to must stay valid until it has completed.
+ */
+struct at_cmd
+{
+    // Reserved for the command queue (k_fifo)
+    void *fifo_reserved;
+    // The command. If there's a payload this is the part before it.
+    const char *cmd;
+    // Optional binary payload, sent as hex after the command
+    const uint8_t *payload;
+    size_t payload_len;
+    // The rest of the command after the payload
+    const char *suffix;
+    // Response decoder. NULL means the response is just OK or ERROR.
+    at_decode_t decode;
+    // Context for the decoder and the completion callback
+    void *ctx;
+    // Result from the decoder
+    int result;
+    at_done_t done;
+    struct k_sem complete;
+};
+
+/**
+ * @brief Queue a command for the modem thread and return immediately.
+ * @param *cmd: The command
+ * @param done: Called on the modem thread when the command has completed
+ */
+void modem_submit(struct at_cmd *cmd, at_done_t done);
+
+/**
+ * @brief Queue a command for the modem thread and wait for it to complete.
+ * @return The result from the decoder (AT_OK, AT_ERROR or AT_TIMEOUT)
+ */
+int modem_exec(struct at_cmd *cmd);
+
 /**
  * @brief Set callback function for new data notifications. This function is
  *        called whenever a +NSOMNI message is received from the modem.
@@ -16,10 +98,32 @@ typedef void (*recv_callback_t)(int fd, size_t bytes);
 void receive_callback(recv_callback_t receive_cb);
 
 /**
- * @brief Initialize communications
+ * @brief Initialize communications. The modem is restarted (unless it is
+ *        already up and running) and attached by a background thread so
+ *        this returns right away. Use modem_link_up() or modem_wait_link()
+ *        to find out when the link is up.
  */
 void modem_init(void);
 
+/**
+ * @brief Check if the link is up, ie the bring-up has completed and the
+ *        modem is registered on the network.
+ */
+bool modem_link_up(void);
+
+/**
+ * @brief Wait until the link is up.
+ * @param timeout: Time to wait
+ * @return 0 when the link is up, -EAGAIN on timeout
+ */
+int modem_wait_link(int32_t timeout);
+
+/**
+ * @brief Set callback function for when the bring-up completes.
+ * @note  Only a single callback can be registered.
+ */
+void link_callback(link_callback_t link_cb);
+
 /**
  * @brief Writes a string to the modem.
  * @param *cmd: The string to send
@@ -27,16 +131,97 @@ void modem_init(void);
 void modem_write(const char *cmd);
 
 /**
- * @brief Read a single character from the modem.
+ * @brief Writes a command with a binary payload to the modem. The payload is
+ *        hex encoded on the fly and streamed out while the UART sends the
+ *        preceding bytes.
+ * @param *prefix: The command up to the payload
+ * @param *data: The payload
+ * @param len: Number of bytes in the payload
+ * @param *suffix: The rest of the command after the payload
+ */
+void modem_write_hex(const char *prefix, const uint8_t *data, size_t len, const char *suffix);
+
+/**
+ * @brief Claim a contiguous region of the received data. The data stays in
+ *        the receive buffer until it is released with modem_read_finish()
+ *        so it can be parsed in place.
+ * @param **data: Set to the start of the region
+ * @param max: Maximum number of bytes to claim
+ * @param timeout: Time to wait for data if the buffer is empty
+ * @return Number of bytes claimed, 0 on timeout
+ * @note  Only a single region can be claimed at a time.
+ */
+size_t modem_read_claim(uint8_t **data, size_t max, int32_t timeout);
+
+/**
+ * @brief Release data claimed with modem_read_claim()
+ * @param len: Number of bytes consumed. Any claimed bytes beyond this are
+ *        returned by the next claim.
  */
-bool modem_read(uint8_t *b, int32_t timeout);
+void modem_read_finish(size_t len);
 
 /**
  * @brief check if modem is ready and online (ie check if there's an assigned IP address)
  */
 bool modem_is_ready();
 
+/**
+ * @brief Check if the modem is registered on the network. Tracked from +CEREG
+ *        so no AT command is sent.
+ */
+bool modem_is_registered(void);
+
+/**
+ * @brief Wait until the modem registers on the network (+CEREG). Returns as
+ *        soon as the URC arrives.
+ * @param timeout: Time to wait
+ * @return 0 when registered, -EAGAIN on timeout
+ */
+int modem_wait_attach(int32_t timeout);
+
 /**
  * Restart modem
  */
-void modem_restart();
\ No newline at end of file
+void modem_restart();
+
+/**
+ * @brief Configure power saving mode (AT+CPSMS).
+ * @param enable: Enable or disable PSM
+ * @param periodic_tau: Requested periodic TAU (T3412) in seconds. Rounded up
+ *        to the nearest value the timer can express.
+ * @param active_time: Requested active time (T3324) in seconds, ie how long
+ *        the modem stays reachable in idle before it enters PSM. Rounded up
+ *        like periodic_tau.
+ * @return AT_OK, AT_ERROR, AT_TIMEOUT or -EINVAL if a timer is out of range
+ * @note  The network decides the actual values.
+ */
+int modem_set_psm(bool enable, uint32_t periodic_tau, uint32_t active_time);
+
+/**
+ * @brief Configure eDRX for NB-IoT (AT+CEDRXS).
+ * @param enable: Enable or disable eDRX
+ * @param edrx: Requested eDRX cycle as the 4 bit value from 3GPP TS 24.008
+ *        table 10.5.5.32 (ie 5 is 81.92 seconds)
+ * @return AT_OK, AT_ERROR, AT_TIMEOUT or -EINVAL if the value is out of range
+ */
+int modem_set_edrx(bool enable, uint8_t edrx);
+
+/**
+ * @brief Current radio state. The state is tracked from URCs so it's free
+ *        to call this before every send.
+ */
+enum modem_radio_state modem_radio_state(void);
+
+/**
+ * @brief Wait until the radio enters a state.
+ * @param state: The state to wait for
+ * @param timeout: Time to wait
+ * @return 0 when the radio is in the state, -EAGAIN on timeout
+ */
+int modem_wait_radio(enum modem_radio_state state, int32_t timeout);
+
+/**
+ * @brief Set callback function for radio state changes.
+ * @note  Only a single callback can be registered.
+ */
+void radio_state_callback(radio_callback_t radio_cb);
\ No newline at end of file
@@ -3,5 +3,31 @@
 #define CONFIG_N2_NAME "SARA_N2"
 // Priority should be higher than the lwm2m service
 #define CONFIG_N2_INIT_PRIORITY 35
+// Largest datagram received. Datagrams larger than 512 bytes are read from the
+// modem in several chunks. This is also the size of the receive pool blocks.
 #define CONFIG_N2_MAX_PACKET_SIZE 512
-
+// Largest datagram sent. The modem accepts at most 512 bytes per AT+NSOST.
+#define CONFIG_N2_MAX_SEND_SIZE 512
+// Number of datagrams that can be read ahead from the modem. The blocks are
+// shared by all sockets and are CONFIG_N2_MAX_PACKET_SIZE bytes each.
+#define CONFIG_N2_RX_POOL_SIZE 4
+// Number of datagrams per socket announced by +NSONMI that are tracked
+// while they are still in the modem
+#define CONFIG_N2_MAX_PENDING 8
+// Number of idle sockets kept open on the modem. They are created in the
+// background when the link comes up and closed sockets are recycled, so
+// socket() and close() don't wait for AT+NSOCR and AT+NSOCL. 0 disables the
+// pool.
+#define CONFIG_N2_SOCKET_POOL_SIZE 2
+// Object id of the LwM2M object with the driver statistics (see stats.h).
+// The id is in the range reserved for private objects.
+#define CONFIG_N2_STATS_OBJ_ID 32769
+// Size in bytes of the AT trace ring buffer (see trace.h). Must be a power of
+// two. Each record takes 8 bytes plus up to 48 bytes of the line. 0 disables
+// the trace.
+#define CONFIG_N2_TRACE_SIZE 2048
+// Replay captured modem output instead of using the UART (see replay.h).
+// Set by "make replay".
+#ifndef CONFIG_N2_REPLAY
+#define CONFIG_N2_REPLAY 0
+#endif
@@ -0,0 +1,81 @@
+#include <string.h>
+#include "hex.h"
+
+// The tables are generated by the preprocessor. HEX_R256(f) expands to
+// f(0), f(1) ... f(255).
+#define HEX_R4(f, n) f(n), f(n + 1), f(n + 2), f(n + 3)
+#define HEX_R16(f, n) HEX_R4(f, n), HEX_R4(f, n + 4), HEX_R4(f, n + 8), HEX_R4(f, n + 12)
+#define HEX_R64(f, n) HEX_R16(f, n), HEX_R16(f, n + 16), HEX_R16(f, n + 32), HEX_R16(f, n + 48)
+#define HEX_R256(f) HEX_R64(f, 0), HEX_R64(f, 64), HEX_R64(f, 128), HEX_R64(f, 192)
+
+#define HEX_DIGIT(n) ((n) <= 9 ? '0' + (n) : 'A' - 10 + (n))
+
+// Both digits of a byte in a single half word. The first digit is in the low
+// byte so a little endian store puts them in the right order.
+#define HEX_PAIR(n) (uint16_t)(HEX_DIGIT((n) >> 4) | (HEX_DIGIT((n)&0xF) << 8))
+
+#define HEX_VALUE(c) (int8_t)(                \
+    ((c) >= '0' && (c) <= '9')   ? (c) - '0'      \
+    : ((c) >= 'A' && (c) <= 'F') ? (c) - 'A' + 10 \
+    : ((c) >= 'a' && (c) <= 'f') ? (c) - 'a' + 10 \
+                                 : -1)
+
+static const uint16_t hex_pairs[256] = {HEX_R256(HEX_PAIR)};
+
+const int8_t hex_values[256] = {HEX_R256(HEX_VALUE)};
+
+size_t hex_encode(const uint8_t *data, size_t len, char *out)
+{
+    size_t i = 0;
+    uint32_t w;
+    // Two bytes in, one word out. memcpy compiles to a single (unaligned)
+    // store on the Cortex-M4.
+    for (; i + 2 <= len; i += 2)
+    {
+        w = hex_pairs[data[i]] | ((uint32_t)hex_pairs[data[i + 1]] << 16);
+        memcpy(out + i * 2, &w, sizeof(w));
+    }
+    if (i < len)
+    {
+        uint16_t h = hex_pairs[data[i]];
+        memcpy(out + i * 2, &h, sizeof(h));
+    }
+    return len * 2;
+}
+
+int hex_decode(const char *hex, size_t len, uint8_t *out)
+{
+    if (len & 1)
+    {
+        return -1;
+    }
+    const uint8_t *in = (const uint8_t *)hex;
+    size_t o = 0;
+    int32_t a, b, c, d;
+    // Four digits at a time. Invalid digits are -1 in the table so OR-ing
+    // the values catches any of them with a single test.
+    for (; len >= 4; len -= 4, in += 4, o += 2)
+    {
+        a = hex_values[in[0]];
+        b = hex_values[in[1]];
+        c = hex_values[in[2]];
+        d = hex_values[in[3]];
+        if ((a | b | c | d) < 0)
+        {
+            return -1;
+        }
+        out[o] = (uint8_t)(a << 4 | b);
+        out[o + 1] = (uint8_t)(c << 4 | d);
+    }
+    if (len == 2)
+    {
+        a = hex_values[in[0]];
+        b = hex_values[in[1]];
+        if ((a | b) < 0)
+        {
+            return -1;
+        }
+        out[o++] = (uint8_t)(a << 4 | b);
+    }
+    return o;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Hex codec for the payloads sent and received through AT+NSOST and
+ * AT+NSORF. Both directions are table driven and work on 32-bit words where
+ * the input allows it.
+ */
+
+extern const int8_t hex_values[256];
+
+/**
+ * @brief Value of a single hex digit (upper or lower case)
+ * @return 0-15 for a valid digit, -1 otherwise
+ */
+static inline int hex_nibble(char c)
+{
+    return hex_values[(uint8_t)c];
+}
+
+/**
+ * @brief Encode a buffer as upper case hex.
+ * @param *data: The bytes to encode
+ * @param len: Number of bytes to encode
+ * @param *out: Output buffer. Must have room for 2 * len characters. The
+ *        output is not NUL terminated.
+ * @return Number of characters written
+ */
+size_t hex_encode(const uint8_t *data, size_t len, char *out);
+
+/**
+ * @brief Decode a hex string. Both upper and lower case digits are accepted.
+ * @param *hex: The hex string
+ * @param len: Number of characters to decode. Must be even.
+ * @param *out: Output buffer. Must have room for len / 2 bytes.
+ * @return Number of bytes decoded, -1 if the input isn't valid hex
+ */
+int hex_decode(const char *hex, size_t len, uint8_t *out);
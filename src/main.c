@@ -20,11 +20,17 @@
 #include <zephyr.h>
 #include <drivers/gpio.h>
 #include <net/socket.h>
+#if defined(CONFIG_BOOTLOADER_MCUBOOT)
 #include "fota.h"
+#endif
 #include "test_udp.h"
 #include "test_coap.h"
 #include "test_modem.h"
+#include "test_hex.h"
+#include "test_replay.h"
+#include "trace.h"
 
+#if defined(CONFIG_BOOTLOADER_MCUBOOT)
 void testFOTA()
 {
     // Initialize the application and run any self-tests before calling fota_init.
@@ -43,13 +49,29 @@ void testFOTA()
         k_sleep(5000);
     }
 }
+#endif
 
 void main(void)
 {
 
     printf("Start\n");
 
+#if CONFIG_N2_REPLAY
+    // Replay build (make replay); there's no modem
+    testReplay();
+#elif defined(CONFIG_BOOTLOADER_MCUBOOT)
     testFOTA();
+#else
+    // No bootloader (ie native_posix against tools/n2sim.py); run the socket
+    // tests instead.
+    testHex();
+    testUDP();
+    testUDPChurn();
+    testUDPTimeout();
+    testUDPStress();
+    // The last AT transactions, for tools/n2trace.py
+    trace_dump();
+#endif
 
     printf("Halting firmware\n");
 }
@@ -17,60 +17,643 @@ LOG_MODULE_REGISTER(n2_offload);
 #include <init.h>
 #include <net/net_offload.h>
 #include <net/socket_offload.h>
+#include <sys/slist.h>
+#include <sys/time.h>
+#include <stdarg.h>
 #include <stdio.h>
 
 #include "config.h"
 #include "comms.h"
 #include "at_commands.h"
+#include "n2_offload.h"
+#include "urc.h"
+
+#ifndef MSG_TRUNC
+#define MSG_TRUNC 0x20
+#endif
+#ifndef SO_RCVTIMEO
+#define SO_RCVTIMEO 20
+#endif
+#ifndef SO_SNDTIMEO
+#define SO_SNDTIMEO 21
+#endif
 
 // The maximum number of sockets in SARA N2 is 7
 #define MDM_MAX_SOCKETS 7
 #define INVALID_FD -1
-#define MAX_RECEIVE 512
+// The modem takes at most 512 bytes per AT+NSOST and returns at most 512
+// bytes per AT+NSORF. Larger datagrams are read in several chunks.
+#define MODEM_MAX_PAYLOAD 512
+
+// Flags for AT+NSOSTF
+#define NSOSTF_RELEASE 0x200
+#define NSOSTF_RELEASE_AFTER_REPLY 0x400
+
+#if CONFIG_N2_MAX_SEND_SIZE > MODEM_MAX_PAYLOAD
+#error "CONFIG_N2_MAX_SEND_SIZE can't be larger than what AT+NSOST accepts (512)"
+#endif
+
+#define CMD_BUFFER_SIZE 64
+
+struct nsorf_result
+{
+    int sockfd;
+    char ip[16];
+    int port;
+    uint8_t *data;
+    size_t received;
+    size_t remaining;
+};
+
+// A datagram read from the modem ahead of the application. The blocks come
+// from a fixed pool shared by all sockets.
+struct rx_dgram
+{
+    sys_snode_t node;
+    struct sockaddr_in from;
+    // Bytes stored in the block
+    size_t len;
+    // Size of the datagram. Anything beyond CONFIG_N2_MAX_PACKET_SIZE is
+    // discarded when it is read from the modem.
+    size_t size;
+    uint8_t data[CONFIG_N2_MAX_PACKET_SIZE];
+};
+
+K_MEM_SLAB_DEFINE(rx_slab, sizeof(struct rx_dgram), CONFIG_N2_RX_POOL_SIZE, 4);
 
 struct n2_socket
 {
     int id;
     int in_use;
     bool connected;
+    // Set while AT+NSOCL is in progress. No more reads are started.
+    bool closing;
+    // Set while the socket is created on the modem for the pool. The slot
+    // is reserved until it completes.
+    bool creating;
     int local_port;
-    ssize_t incoming_len;
-    void *remote_addr;
-    ssize_t remote_len;
+    // Lengths of the datagrams announced by +NSONMI that are still in the
+    // modem, oldest first. This is a single producer/single consumer ring
+    // so URC handling never waits for mdm_sem: the URC handler writes an
+    // entry and then advances the tail, the readers (with mdm_sem held)
+    // advance the head. Both are free-running counters.
+    u16_t pending[CONFIG_N2_MAX_PENDING];
+    atomic_t pending_head;
+    atomic_t pending_tail;
+    // Set if +NSONMI arrived with the pending list full. The sizes of those
+    // datagrams are unknown so they are read with the maximum size until the
+    // modem returns nothing.
+    atomic_t pending_overflow;
+    // Set by the URC handler on +NSOCLI and handled by rx_work
+    atomic_t modem_closed;
+    // Set by connect(). Kept in the socket table so the driver doesn't need
+    // the heap.
+    struct sockaddr_in remote_addr;
+    socklen_t remote_len;
+    // Set with fcntl(F_SETFL, O_NONBLOCK). Same as MSG_DONTWAIT on every call.
+    bool nonblock;
+    // SO_RCVTIMEO and SO_SNDTIMEO. A send only waits for the link.
+    s32_t rcv_timeout;
+    s32_t snd_timeout;
+    // Threads blocked in recvfrom() or poll(). Woken by receive_cb() when
+    // data arrives on the socket and when a prefetched datagram is queued.
+    sys_slist_t rx_waiters;
+    // Datagrams read from the modem, oldest first
+    sys_slist_t rx_queue;
+    // Set while an AT+NSORF is in flight for the socket, either a prefetch
+    // or a direct read. Reads are serialised so datagrams stay in order.
+    bool reading;
+    struct at_cmd rx_cmd;
+    char rx_cmdbuf[CMD_BUFFER_SIZE];
+    struct nsorf_result rx_res;
+    struct rx_dgram *rx_block;
 };
 
 static struct n2_socket sockets[MDM_MAX_SOCKETS];
 
-static int next_free_port = 6000;
+// A thread waiting for data on a socket. Each waiter polls on its own
+// signal; a raise only wakes one poller and a waiter that resets a shared
+// signal could clear a raise another one hasn't seen.
+struct rx_waiter
+{
+    sys_snode_t node;
+    struct k_poll_signal signal;
+    struct n2_socket *sock;
+};
 
-#define CMD_BUFFER_SIZE 64
-static char modem_command_buffer[CMD_BUFFER_SIZE];
+static int next_free_port = 6000;
 
 #define CMD_TIMEOUT 2000
 
-#define TO_HEX(i) (i <= 9 ? '0' + i : 'A' - 10 + i)
 #define S_TO_I(s) (s - 100)
 #define I_TO_S(i) (i + 100)
 #define VALID_SOCKET(s) (s >= 100 && s <= (100 + MDM_MAX_SOCKETS) && sockets[s-100].in_use)
 
+// Protects the socket table. AT commands are serialised by the modem thread
+// so the semaphore is never held across a modem round trip.
 static struct k_sem mdm_sem;
 
+// Serialises creating and closing sockets on the modem. Sockets are created
+// lazily so this is held across AT+NSOCR and AT+NSOCL.
+static struct k_mutex create_lock;
+
+// Sockets are pooled: a slot that isn't in use but has a modem socket is
+// idle and is handed out by socket() without a round trip. The pool is
+// filled in the background one AT+NSOCR at a time.
+static struct at_cmd pool_cmd;
+static char pool_cmdbuf[CMD_BUFFER_SIZE];
+static int pool_sockfd;
+static bool pool_busy = false;
+
+// Response decoders for the commands queued by the socket calls
+
+static int nsocr_decode(struct at_cmd *cmd)
+{
+    return atnsocr_decode((int *)cmd->ctx);
+}
+
+struct nsost_result
+{
+    int sockfd;
+    size_t sent;
+};
+
+static int nsost_decode(struct at_cmd *cmd)
+{
+    struct nsost_result *r = (struct nsost_result *)cmd->ctx;
+    return atnsost_decode(&r->sockfd, &r->sent);
+}
+
+static int nsorf_decode(struct at_cmd *cmd)
+{
+    struct nsorf_result *r = (struct nsorf_result *)cmd->ctx;
+    return atnsorf_decode(&r->sockfd, r->ip, &r->port, r->data, &r->received, &r->remaining);
+}
+
+static u32_t pending_count(struct n2_socket *sock)
+{
+    return (u32_t)atomic_get(&sock->pending_tail) - (u32_t)atomic_get(&sock->pending_head);
+}
+
+/**
+ * @brief Record a datagram announced by +NSONMI. This is the producer side
+ *        of the pending ring and runs on the modem thread without locks.
+ */
+static void pending_add(struct n2_socket *sock, size_t len)
+{
+    atomic_val_t tail = atomic_get(&sock->pending_tail);
+    if ((u32_t)tail - (u32_t)atomic_get(&sock->pending_head) >= CONFIG_N2_MAX_PENDING)
+    {
+        atomic_set(&sock->pending_overflow, 1);
+        return;
+    }
+    sock->pending[(u32_t)tail % CONFIG_N2_MAX_PENDING] = len;
+    // Publish the entry
+    atomic_set(&sock->pending_tail, tail + 1);
+}
+
+static bool pending_any(struct n2_socket *sock)
+{
+    return pending_count(sock) > 0 || atomic_get(&sock->pending_overflow);
+}
+
+/**
+ * @brief Size of the first AT+NSORF read for the next datagram in the modem.
+ *        The "remaining" field in the response says if there's more.
+ */
+static size_t pending_next(struct n2_socket *sock)
+{
+    if (pending_count(sock) == 0)
+    {
+        return MODEM_MAX_PAYLOAD;
+    }
+    u32_t head = atomic_get(&sock->pending_head);
+    return MIN(sock->pending[head % CONFIG_N2_MAX_PENDING], MODEM_MAX_PAYLOAD);
+}
+
+/**
+ * @brief Drop the datagrams announced so far. Entries the URC handler adds
+ *        while this runs are kept.
+ */
+static void pending_clear(struct n2_socket *sock)
+{
+    atomic_clear(&sock->pending_overflow);
+    atomic_set(&sock->pending_head, atomic_get(&sock->pending_tail));
+}
+
+/**
+ * @brief Account for a datagram read from the modem with AT+NSORF
+ */
+static void rx_consumed(struct n2_socket *sock, int result, size_t received)
+{
+    if (result != AT_OK || received == 0)
+    {
+        // The modem has nothing more (or the socket is gone). Don't keep
+        // asking for it.
+        pending_clear(sock);
+        return;
+    }
+    if (pending_count(sock) > 0)
+    {
+        atomic_inc(&sock->pending_head);
+    }
+}
+
+/**
+ * @brief True if recvfrom() has something to return for the socket. Data
+ *        left in the modem only counts when it isn't being prefetched, ie
+ *        when the pool has run out of blocks.
+ */
+static bool rx_ready(struct n2_socket *sock)
+{
+    return !sys_slist_is_empty(&sock->rx_queue) ||
+           (pending_any(sock) && !sock->reading);
+}
+
+/**
+ * @brief Start waiting for data on the socket. Call before looking at the
+ *        socket so data that arrives after the check isn't missed.
+ */
+static void rx_waiter_add(struct n2_socket *sock, struct rx_waiter *w)
+{
+    k_poll_signal_init(&w->signal);
+    w->sock = sock;
+    unsigned int key = irq_lock();
+    sys_slist_append(&sock->rx_waiters, &w->node);
+    irq_unlock(key);
+}
+
+static void rx_waiter_remove(struct rx_waiter *w)
+{
+    unsigned int key = irq_lock();
+    sys_slist_find_and_remove(&w->sock->rx_waiters, &w->node);
+    irq_unlock(key);
+}
+
+/**
+ * @brief Wake all threads waiting for data on the socket
+ */
+static void rx_notify(struct n2_socket *sock)
+{
+    struct rx_waiter *w;
+    unsigned int key = irq_lock();
+    SYS_SLIST_FOR_EACH_CONTAINER(&sock->rx_waiters, w, node)
+    {
+        k_poll_signal_raise(&w->signal, 0);
+    }
+    irq_unlock(key);
+}
+
+static void rx_prefetch_done(struct at_cmd *cmd);
+static void rx_drain_done(struct at_cmd *cmd);
+
+/**
+ * @brief Queue an AT+NSORF on the socket's command. A NULL destination
+ *        discards the data.
+ */
+static void rx_submit(struct n2_socket *sock, size_t size, uint8_t *dst, at_done_t done)
+{
+    sprintf(sock->rx_cmdbuf, "AT+NSORF=%d,%d\r", sock->id, size);
+    sock->rx_res = (struct nsorf_result){
+        .data = dst,
+    };
+    sock->rx_cmd = (struct at_cmd){
+        .cmd = sock->rx_cmdbuf,
+        .decode = nsorf_decode,
+        .ctx = &sock->rx_res,
+    };
+    modem_submit(&sock->rx_cmd, done);
+}
+
+/**
+ * @brief Queue an AT+NSORF for the next chunk of the datagram being read
+ *        into the socket's pool block. Chunks that don't fit in the block
+ *        are read and discarded.
+ */
+static void rx_prefetch_chunk(struct n2_socket *sock, size_t size)
+{
+    struct rx_dgram *d = sock->rx_block;
+    uint8_t *dst = NULL;
+    if (d->len < CONFIG_N2_MAX_PACKET_SIZE)
+    {
+        dst = d->data + d->len;
+        size = MIN(size, CONFIG_N2_MAX_PACKET_SIZE - d->len);
+    }
+    rx_submit(sock, size, dst, rx_prefetch_done);
+}
+
+/**
+ * @brief Start reading the next datagram from the modem into a pool block
+ *        if there's data waiting. Called with mdm_sem held.
+ */
+static void rx_prefetch(struct n2_socket *sock)
+{
+    if (sock->closing || sock->reading || sock->id < 0 || !pending_any(sock))
+    {
+        return;
+    }
+    if (!sock->in_use)
+    {
+        // Idle in the pool. Whatever arrives is stale so drain it before
+        // the socket is handed out again.
+        sock->reading = true;
+        rx_submit(sock, pending_next(sock), NULL, rx_drain_done);
+        return;
+    }
+    if (k_mem_slab_alloc(&rx_slab, (void **)&sock->rx_block, K_NO_WAIT) != 0)
+    {
+        // Pool is empty. The data stays in the modem until a block is
+        // released or recvfrom() reads it directly.
+        sock->rx_block = NULL;
+        return;
+    }
+    sock->rx_block->len = 0;
+    sock->rx_block->size = 0;
+    sock->reading = true;
+    rx_prefetch_chunk(sock, pending_next(sock));
+}
+
+/**
+ * @brief Restart reading on all sockets after a pool block is released.
+ *        Called with mdm_sem held.
+ */
+static void rx_prefetch_all(void)
+{
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
+    {
+        rx_prefetch(&sockets[i]);
+    }
+}
+
+/**
+ * @brief Completion for the prefetch command. Runs on the modem thread.
+ */
+static void rx_prefetch_done(struct at_cmd *cmd)
+{
+    struct n2_socket *sock = CONTAINER_OF(cmd, struct n2_socket, rx_cmd);
+    struct nsorf_result *res = &sock->rx_res;
+
+    k_sem_take(&mdm_sem, K_FOREVER);
+    struct rx_dgram *d = sock->rx_block;
+    if (cmd->result == AT_OK && res->received > 0)
+    {
+        if (d->size == 0)
+        {
+            memset(&d->from, 0, sizeof(d->from));
+            d->from.sin_family = AF_INET;
+            d->from.sin_port = htons(res->port);
+            inet_pton(AF_INET, res->ip, &d->from.sin_addr);
+        }
+        if (res->data)
+        {
+            d->len += res->received;
+        }
+        d->size += res->received;
+        if (res->remaining > 0 && !sock->closing)
+        {
+            // Keep the block and read the rest of the datagram
+            rx_prefetch_chunk(sock, MIN(res->remaining, MODEM_MAX_PAYLOAD));
+            k_sem_give(&mdm_sem);
+            return;
+        }
+    }
+    sock->rx_block = NULL;
+    sock->reading = false;
+    rx_consumed(sock, d->size > 0 ? AT_OK : cmd->result, d->size);
+    if (d->size > 0 && sock->in_use && !sock->closing)
+    {
+        sys_slist_append(&sock->rx_queue, &d->node);
+        d = NULL;
+    }
+    if (d)
+    {
+        k_mem_slab_free(&rx_slab, (void **)&d);
+    }
+    rx_prefetch(sock);
+    rx_notify(sock);
+    k_sem_give(&mdm_sem);
+}
+
+/**
+ * @brief Release the socket to the pool. The modem socket is kept and
+ *        anything the previous owner left behind is dropped. Called with
+ *        mdm_sem held.
+ */
+static void recycle_socket(int sock_fd)
+{
+    sockets[sock_fd].connected = false;
+    sockets[sock_fd].in_use = false;
+    sockets[sock_fd].remote_len = 0;
+    memset(&sockets[sock_fd].remote_addr, 0, sizeof(sockets[sock_fd].remote_addr));
+    sys_snode_t *node;
+    while ((node = sys_slist_get(&sockets[sock_fd].rx_queue)) != NULL)
+    {
+        struct rx_dgram *d = CONTAINER_OF(node, struct rx_dgram, node);
+        k_mem_slab_free(&rx_slab, (void **)&d);
+    }
+    // Wake up anyone blocked on the socket
+    rx_notify(&sockets[sock_fd]);
+}
+
 /**
  * @brief Clear socket state
  */
 static void clear_socket(int sock_fd)
 {
+    recycle_socket(sock_fd);
+    // The URC handler matches on the id so clear it before the pending state
     sockets[sock_fd].id = -1;
-    sockets[sock_fd].connected = false;
-    sockets[sock_fd].in_use = false;
+    sockets[sock_fd].closing = false;
     sockets[sock_fd].local_port = 0;
-    sockets[sock_fd].incoming_len = 0;
-    sockets[sock_fd].remote_len = 0;
-    if (sockets[sock_fd].remote_addr != NULL)
+    pending_clear(&sockets[sock_fd]);
+    atomic_clear(&sockets[sock_fd].modem_closed);
+}
+
+/**
+ * @brief Completion for a drain read on an idle socket. Runs on the modem
+ *        thread.
+ */
+static void rx_drain_done(struct at_cmd *cmd)
+{
+    struct n2_socket *sock = CONTAINER_OF(cmd, struct n2_socket, rx_cmd);
+    struct nsorf_result *res = &sock->rx_res;
+
+    k_sem_take(&mdm_sem, K_FOREVER);
+    if (cmd->result == AT_OK && res->received > 0 && res->remaining > 0)
+    {
+        // The rest of the datagram
+        rx_submit(sock, MIN(res->remaining, MODEM_MAX_PAYLOAD), NULL, rx_drain_done);
+        k_sem_give(&mdm_sem);
+        return;
+    }
+    sock->reading = false;
+    rx_consumed(sock, cmd->result, res->received);
+    if (sock->closing)
+    {
+        // Closed by the modem while it was drained
+        clear_socket(sock - sockets);
+    }
+    rx_prefetch(sock);
+    k_sem_give(&mdm_sem);
+}
+
+/**
+ * @brief True if the socket is idle in the pool and can be handed out, ie
+ *        there's nothing left to drain
+ */
+static bool pool_ready(struct n2_socket *sock)
+{
+    return !sock->in_use && sock->id >= 0 && !sock->closing &&
+           !sock->reading && !pending_any(sock) && !atomic_get(&sock->modem_closed);
+}
+
+/**
+ * @brief Number of idle sockets in the pool, including the one being
+ *        created. Called with mdm_sem held.
+ */
+static int pool_count(void)
+{
+    int count = 0;
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
     {
-        k_free(sockets[sock_fd].remote_addr);
-        sockets[sock_fd].remote_addr = NULL;
+        if (!sockets[i].in_use && (sockets[i].id >= 0 || sockets[i].creating))
+        {
+            count++;
+        }
     }
+    return count;
+}
+
+static void pool_create_done(struct at_cmd *cmd);
+
+/**
+ * @brief Create another socket for the pool in the background if it isn't
+ *        full. Called with mdm_sem held.
+ */
+static void pool_fill(void)
+{
+    if (pool_busy || !modem_link_up() || pool_count() >= CONFIG_N2_SOCKET_POOL_SIZE)
+    {
+        return;
+    }
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
+    {
+        struct n2_socket *sock = &sockets[i];
+        if (!sock->in_use && sock->id < 0)
+        {
+            pool_busy = true;
+            sock->creating = true;
+            sock->local_port = next_free_port++;
+            sprintf(pool_cmdbuf, "AT+NSOCR=\"DGRAM\",17,%d,1\r", sock->local_port);
+            pool_sockfd = -1;
+            pool_cmd = (struct at_cmd){
+                .cmd = pool_cmdbuf,
+                .decode = nsocr_decode,
+                .ctx = &pool_sockfd,
+            };
+            modem_submit(&pool_cmd, pool_create_done);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Completion for AT+NSOCR for the pool. Runs on the modem thread.
+ */
+static void pool_create_done(struct at_cmd *cmd)
+{
+    k_sem_take(&mdm_sem, K_FOREVER);
+    pool_busy = false;
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
+    {
+        if (sockets[i].creating)
+        {
+            sockets[i].creating = false;
+            if (cmd->result == AT_OK && pool_sockfd >= 0)
+            {
+                sockets[i].id = pool_sockfd;
+                pool_fill();
+            }
+            else
+            {
+                LOG_WRN("Unable to create pooled socket");
+                sockets[i].local_port = 0;
+            }
+        }
+    }
+    k_sem_give(&mdm_sem);
+}
+
+/**
+ * @brief Create the socket on the modem if it hasn't been created yet.
+ *        socket() doesn't wait for the link so this is done on first use
+ *        or when the link comes up.
+ * @param timeout: Time to wait for the link
+ * @return 0 when the socket exists on the modem, -EAGAIN if the link isn't
+ *         up in time
+ */
+static int socket_create(int sock_fd, s32_t timeout)
+{
+    struct n2_socket *sock = &sockets[sock_fd];
+    k_sem_take(&mdm_sem, K_FOREVER);
+    bool created = sock->id >= 0;
+    k_sem_give(&mdm_sem);
+    if (created)
+    {
+        return 0;
+    }
+    if (!modem_link_up() && modem_wait_link(timeout) != 0)
+    {
+        return -EAGAIN;
+    }
+
+    k_mutex_lock(&create_lock, K_FOREVER);
+    k_sem_take(&mdm_sem, K_FOREVER);
+    if (!sock->in_use || sock->closing || sock->id >= 0)
+    {
+        int ret = sock->id >= 0 ? 0 : -EBADF;
+        k_sem_give(&mdm_sem);
+        k_mutex_unlock(&create_lock);
+        return ret;
+    }
+    char cmdbuf[CMD_BUFFER_SIZE];
+    sprintf(cmdbuf, "AT+NSOCR=\"DGRAM\",17,%d,1\r", sock->local_port);
+    k_sem_give(&mdm_sem);
+
+    int sockfd = -1;
+    struct at_cmd cmd = {
+        .cmd = cmdbuf,
+        .decode = nsocr_decode,
+        .ctx = &sockfd,
+    };
+    int res = modem_exec(&cmd);
+
+    k_sem_take(&mdm_sem, K_FOREVER);
+    if (res == AT_OK)
+    {
+        sock->id = sockfd;
+    }
+    k_sem_give(&mdm_sem);
+    k_mutex_unlock(&create_lock);
+    return res == AT_OK ? 0 : -ENOMEM;
+}
+
+/**
+ * @brief Create the sockets that were opened before the link came up and
+ *        start filling the pool. Runs on the bring-up thread.
+ */
+static void link_up_cb(void)
+{
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
+    {
+        if (sockets[i].in_use)
+        {
+            socket_create(i, K_NO_WAIT);
+        }
+    }
+    k_sem_take(&mdm_sem, K_FOREVER);
+    pool_fill();
+    k_sem_give(&mdm_sem);
 }
 
 static int offload_close(int sfd)
@@ -80,17 +663,49 @@ static int offload_close(int sfd)
         return -EINVAL;
     }
     int sock_fd = S_TO_I(sfd);
+    char cmdbuf[CMD_BUFFER_SIZE];
+    k_mutex_lock(&create_lock, K_FOREVER);
     k_sem_take(&mdm_sem, K_FOREVER);
-    sprintf(modem_command_buffer, "AT+NSOCL=%d\r", sockets[sock_fd].id);
-    modem_write(modem_command_buffer);
+    if (sockets[sock_fd].id < 0 || atomic_get(&sockets[sock_fd].modem_closed))
+    {
+        // Never created on the modem or already closed by it. The modem
+        // hands the number out again so the slot can't go to the pool.
+        clear_socket(sock_fd);
+        k_sem_give(&mdm_sem);
+        k_mutex_unlock(&create_lock);
+        return 0;
+    }
+    if (pool_count() < CONFIG_N2_SOCKET_POOL_SIZE)
+    {
+        // Keep the modem socket for the next socket() call. Data that is
+        // still in the modem is drained in the background.
+        recycle_socket(sock_fd);
+        rx_prefetch_all();
+        k_sem_give(&mdm_sem);
+        k_mutex_unlock(&create_lock);
+        return 0;
+    }
+    // A prefetch that is already queued completes before AT+NSOCL.
+    sockets[sock_fd].closing = true;
+    sprintf(cmdbuf, "AT+NSOCL=%d\r", sockets[sock_fd].id);
+    k_sem_give(&mdm_sem);
 
-    if (atnsocl_decode() != AT_OK)
+    struct at_cmd cmd = {
+        .cmd = cmdbuf,
+    };
+    if (modem_exec(&cmd) != AT_OK)
     {
+        k_sem_take(&mdm_sem, K_FOREVER);
+        sockets[sock_fd].closing = false;
         k_sem_give(&mdm_sem);
+        k_mutex_unlock(&create_lock);
         return -ENOMEM;
     }
+    k_sem_take(&mdm_sem, K_FOREVER);
     clear_socket(sock_fd);
+    rx_prefetch_all();
     k_sem_give(&mdm_sem);
+    k_mutex_unlock(&create_lock);
     return 0;
 }
 
@@ -101,6 +716,11 @@ static int offload_connect(int sfd, const struct sockaddr *addr,
     {
         return -EINVAL;
     }
+    if (addr == NULL || addr->sa_family != AF_INET ||
+        addrlen < sizeof(struct sockaddr_in))
+    {
+        return -EINVAL;
+    }
     int sock_fd = S_TO_I(sfd);
     k_sem_take(&mdm_sem, K_FOREVER);
     // Find matching socket, then check if it created on the modem. It shouldn't be created
@@ -110,135 +730,343 @@ static int offload_connect(int sfd, const struct sockaddr *addr,
         return -EISCONN;
     }
 
+    // Connecting again replaces the remote address
     sockets[sock_fd].connected = true;
-    sockets[sock_fd].remote_addr = k_malloc(addrlen);
-    memcpy(sockets[sock_fd].remote_addr, addr, addrlen);
+    memcpy(&sockets[sock_fd].remote_addr, addr, sizeof(struct sockaddr_in));
+    sockets[sock_fd].remote_len = sizeof(struct sockaddr_in);
     k_sem_give(&mdm_sem);
     return 0;
 }
 
 static int offload_poll(struct pollfd *fds, int nfds, int msecs)
 {
-    // Not *quite* how it should behave but close enough.
-    if (msecs > 0) {
-        k_sleep(msecs);
+    struct k_poll_event events[MDM_MAX_SOCKETS];
+    struct rx_waiter waiters[MDM_MAX_SOCKETS];
+    s32_t timeout = (msecs < 0) ? K_FOREVER : msecs;
+    s64_t start = k_uptime_get();
+
+    while (true)
+    {
+        int ready = 0;
+        int nevents = 0;
+        int polled;
+        k_sem_take(&mdm_sem, K_FOREVER);
+        for (int i = 0; i < nfds; i++)
+        {
+            fds[i].revents = 0;
+            if (!VALID_SOCKET(fds[i].fd))
+            {
+                fds[i].revents = POLLNVAL;
+                ready++;
+                continue;
+            }
+            struct n2_socket *sock = &sockets[S_TO_I(fds[i].fd)];
+            // Sends are synchronous so the socket is always writable
+            if (fds[i].events & POLLOUT)
+            {
+                fds[i].revents |= POLLOUT;
+            }
+            if (fds[i].events & POLLIN)
+            {
+                // Wait before looking at the queue. If data arrives after
+                // the check the signal is raised and k_poll() returns
+                // immediately.
+                if (nevents < MDM_MAX_SOCKETS)
+                {
+                    rx_waiter_add(sock, &waiters[nevents]);
+                    k_poll_event_init(&events[nevents], K_POLL_TYPE_SIGNAL,
+                                      K_POLL_MODE_NOTIFY_ONLY, &waiters[nevents].signal);
+                    nevents++;
+                }
+                if (rx_ready(sock))
+                {
+                    fds[i].revents |= POLLIN;
+                }
+            }
+            if (fds[i].revents)
+            {
+                ready++;
+            }
+        }
+        k_sem_give(&mdm_sem);
+
+        if (ready > 0 || timeout == K_NO_WAIT)
+        {
+            polled = ready;
+        }
+        else if (nevents == 0)
+        {
+            // Nothing that can become ready. Sleep for the timeout like
+            // poll() does so callers that loop on it don't spin.
+            k_sleep(timeout);
+            polled = 0;
+        }
+        else if (k_poll(events, nevents, timeout) != 0)
+        {
+            // Timed out
+            polled = 0;
+        }
+        else
+        {
+            polled = -1;
+        }
+        for (int i = 0; i < nevents; i++)
+        {
+            rx_waiter_remove(&waiters[i]);
+        }
+        if (polled >= 0)
+        {
+            return polled;
+        }
+        if (timeout != K_FOREVER)
+        {
+            timeout = MAX(0, msecs - (s32_t)(k_uptime_get() - start));
+        }
     }
-    k_sem_take(&mdm_sem, K_FOREVER);
-    for (int i = 0; i < nfds; i++)
+}
+
+/**
+ * @brief Fill in the source address for recvfrom()
+ */
+static void set_from(const struct sockaddr_in *addr, struct sockaddr *from, socklen_t *fromlen)
+{
+    if (fromlen != NULL)
+    {
+        *fromlen = sizeof(struct sockaddr_in);
+    }
+    if (from != NULL)
+    {
+        memcpy(from, addr, sizeof(struct sockaddr_in));
+    }
+}
+
+/**
+ * @brief Time a call may block. MSG_DONTWAIT and O_NONBLOCK make it return
+ *        right away, otherwise the socket timeout applies.
+ */
+static s32_t call_timeout(struct n2_socket *sock, int flags, s32_t timeout)
+{
+    if ((flags & MSG_DONTWAIT) == MSG_DONTWAIT || sock->nonblock)
+    {
+        return K_NO_WAIT;
+    }
+    return timeout;
+}
+
+/**
+ * @brief What is left of a timeout that started at start
+ */
+static s32_t time_left(s64_t start, s32_t timeout)
+{
+    if (timeout == K_FOREVER)
+    {
+        return K_FOREVER;
+    }
+    return MAX(0, timeout - (s32_t)(k_uptime_get() - start));
+}
+
+/**
+ * @brief Wait until recvfrom() has something to return. Wakes as soon as
+ *        receive_cb() or a prefetch calls rx_notify().
+ * @param peek: Wait for a prefetched datagram. Data in the modem can't be
+ *        peeked at.
+ * @return 0 when data is ready, -EAGAIN on timeout, -EBADF if the socket
+ *         is closed
+ */
+static int rx_wait(struct n2_socket *sock, s32_t timeout, bool peek)
+{
+    struct rx_waiter w;
+    rx_waiter_add(sock, &w);
+    struct k_poll_event event = K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL,
+                                                         K_POLL_MODE_NOTIFY_ONLY,
+                                                         &w.signal);
+    s64_t start = k_uptime_get();
+    int ret;
+    while (true)
     {
-        if (!VALID_SOCKET(fds[i].fd))
+        k_sem_take(&mdm_sem, K_FOREVER);
+        // Reset before checking so data that arrives after the check
+        // isn't missed
+        k_poll_signal_reset(&w.signal);
+        bool ready = peek ? !sys_slist_is_empty(&sock->rx_queue) : rx_ready(sock);
+        bool open = sock->in_use;
+        k_sem_give(&mdm_sem);
+        if (!open)
         {
-            fds[i].revents = POLLNVAL;
-            continue;
+            ret = -EBADF;
+            break;
+        }
+        if (ready)
+        {
+            ret = 0;
+            break;
         }
-        fds[i].revents = POLLOUT;
-        if (sockets[S_TO_I(fds[i].fd)].incoming_len > 0)
+        s32_t left = time_left(start, timeout);
+        event.state = K_POLL_STATE_NOT_READY;
+        if (left == K_NO_WAIT || k_poll(&event, 1, left) != 0)
         {
-            fds[i].revents |= POLLIN;
+            ret = -EAGAIN;
+            break;
         }
     }
-    k_sem_give(&mdm_sem);
-    return 0;
+    rx_waiter_remove(&w);
+    return ret;
 }
 
 static int offload_recvfrom(int sfd, void *buf, short int len,
                             short int flags, struct sockaddr *from,
                             socklen_t *fromlen)
 {
-    ARG_UNUSED(flags);
     if (!VALID_SOCKET(sfd))
     {
         return -EINVAL;
     }
     int sock_fd = S_TO_I(sfd);
-    k_sem_take(&mdm_sem, K_FOREVER);
+    struct n2_socket *sock = &sockets[sock_fd];
+    // Blocks until there's data unless the call is non-blocking. Nothing can
+    // arrive before the socket exists on the modem.
+    s32_t timeout = call_timeout(sock, flags, sock->rcv_timeout);
+    s64_t start = k_uptime_get();
+    bool peek = (flags & MSG_PEEK) == MSG_PEEK;
+    int err = socket_create(sock_fd, timeout);
+    while (err == 0)
+    {
+        err = rx_wait(sock, time_left(start, timeout), peek);
+        if (err != 0)
+        {
+            break;
+        }
+        k_sem_take(&mdm_sem, K_FOREVER);
 
-    // Now here's an interesting bit of information: If you send AT+NSORF *before*
-    // you receive the +NSONMI URC from the module you'll get just three fields
-    // in return: socket, data, remaining. IT WOULD HAVE BEEN REALLY NICE IF THE
-    // DOCUMENTATION INCLUDED THIS.
+        // Serve prefetched datagrams from RAM. Each call returns a single
+        // datagram and anything that doesn't fit in the buffer is discarded.
+        sys_snode_t *node = sys_slist_peek_head(&sock->rx_queue);
+        if (node != NULL)
+        {
+            struct rx_dgram *d = CONTAINER_OF(node, struct rx_dgram, node);
+            size_t dgram_len = d->size;
+            size_t n = MIN((size_t)len, d->len);
+            memcpy(buf, d->data, n);
+            set_from(&d->from, from, fromlen);
+            if (!peek)
+            {
+                sys_slist_get(&sock->rx_queue);
+                k_mem_slab_free(&rx_slab, (void **)&d);
+                rx_prefetch_all();
+            }
+            k_sem_give(&mdm_sem);
+            return ((flags & MSG_TRUNC) == MSG_TRUNC) ? dgram_len : n;
+        }
 
-    if (sockets[sock_fd].incoming_len == 0)
-    {
+        // Reading directly from the modem is the fallback when the pool is
+        // empty. Peeking needs a pool block to keep the datagram in.
+        if (rx_ready(sock) && !peek)
+        {
+            break;
+        }
         k_sem_give(&mdm_sem);
-        errno = EWOULDBLOCK;
-        return 0;
-    }
 
-    // Use NSORF to read incoming data.
-    memset(modem_command_buffer, 0, sizeof(modem_command_buffer));
-    if (len > MAX_RECEIVE) {
-        len = MAX_RECEIVE;
+        // A prefetch that started after the wait holds the next datagram,
+        // or another reader took it. Wait again unless the call doesn't
+        // block or the time is up.
+        if (time_left(start, timeout) == K_NO_WAIT)
+        {
+            err = -EAGAIN;
+        }
+    }
+    if (err != 0)
+    {
+        errno = -err;
+        return err;
     }
-    sprintf(modem_command_buffer, "AT+NSORF=%d,%d\r", sockets[sock_fd].id, len);
-    modem_write(modem_command_buffer);
 
-    char ip[16];
-    int port = 0;
-    size_t remain = 0;
-    int sockfd = 0;
-    size_t received = 0;
+    // Now here's an interesting bit of information: If you send AT+NSORF *before*
+    // you receive the +NSONMI URC from the module you'll get just three fields
+    // in return: socket, data, remaining. IT WOULD HAVE BEEN REALLY NICE IF THE
+    // DOCUMENTATION INCLUDED THIS.
 
-    int res = atnsorf_decode(&sockfd, ip, &port, buf, &received, &remain);
-    if (res == AT_OK)
+    // Use NSORF to read incoming data straight into the buffer. Datagrams
+    // larger than a single read are drained in chunks and anything that
+    // doesn't fit in the buffer is discarded.
+    size_t next = pending_next(sock);
+    sock->reading = true;
+    k_sem_give(&mdm_sem);
+
+    char cmdbuf[CMD_BUFFER_SIZE];
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+    };
+    size_t copied = 0;
+    size_t dgram_len = 0;
+    int result;
+    struct nsorf_result res;
+    do
     {
-        if (received == 0)
+        uint8_t *dst = NULL;
+        if (copied < (size_t)len)
         {
-            k_sem_give(&mdm_sem);
-            return 0;
+            dst = (uint8_t *)buf + copied;
+            next = MIN(next, (size_t)len - copied);
+        }
+        sprintf(cmdbuf, "AT+NSORF=%d,%d\r", sock->id, next);
+        res = (struct nsorf_result){
+            .data = dst,
+        };
+        struct at_cmd cmd = {
+            .cmd = cmdbuf,
+            .decode = nsorf_decode,
+            .ctx = &res,
+        };
+        result = modem_exec(&cmd);
+        if (result != AT_OK || res.received == 0)
+        {
+            break;
         }
-        if (fromlen != NULL)
+        if (dgram_len == 0)
         {
-            *fromlen = sizeof(struct sockaddr_in);
+            addr.sin_port = htons(res.port);
+            inet_pton(AF_INET, res.ip, &addr.sin_addr);
         }
-        if (from != NULL)
+        if (dst)
         {
-            ((struct sockaddr_in *)from)->sin_family = AF_INET;
-            ((struct sockaddr_in *)from)->sin_port = htons(port);
-            inet_pton(AF_INET, ip, &((struct sockaddr_in *)from)->sin_addr);
+            copied += res.received;
         }
-        sockets[sock_fd].incoming_len = remain;
-        k_sem_give(&mdm_sem);
-        return received;
-    }
+        dgram_len += res.received;
+        next = MIN(res.remaining, MODEM_MAX_PAYLOAD);
+    } while (res.remaining > 0);
+
+    k_sem_take(&mdm_sem, K_FOREVER);
+    sock->reading = false;
+    rx_consumed(sock, dgram_len > 0 ? AT_OK : result, dgram_len);
+    rx_prefetch(sock);
     k_sem_give(&mdm_sem);
+
+    if (dgram_len > 0)
+    {
+        set_from(&addr, from, fromlen);
+        return ((flags & MSG_TRUNC) == MSG_TRUNC) ? dgram_len : copied;
+    }
+    if (result == AT_OK)
+    {
+        return 0;
+    }
     errno = -ENOMEM;
     return -ENOMEM;
 }
 
 static int offload_recv(int sfd, void *buf, size_t max_len, int flags)
 {
-    ARG_UNUSED(flags);
-
     if (!VALID_SOCKET(sfd))
     {
         return -EINVAL;
     }
     int sock_fd = S_TO_I(sfd);
     k_sem_take(&mdm_sem, K_FOREVER);
-    if (!sockets[sock_fd].connected)
-    {
-        k_sem_give(&mdm_sem);
-        return -EINVAL;
-    }
-
-    if (sockets[sock_fd].incoming_len == 0 && ((flags & MSG_DONTWAIT) == MSG_DONTWAIT))
-    {
-        k_sem_give(&mdm_sem);
-        errno = EWOULDBLOCK;
-        return 0;
-    }
-
-    int curcount = sockets[sock_fd].incoming_len;
+    bool connected = sockets[sock_fd].connected;
     k_sem_give(&mdm_sem);
-
-    while (curcount == 0)
+    if (!connected)
     {
-        // busy wait for data
-        k_sleep(1000);
-        k_sem_take(&mdm_sem, K_FOREVER);
-        curcount = sockets[sock_fd].incoming_len;
-        k_sem_give(&mdm_sem);
+        return -EINVAL;
     }
     return offload_recvfrom(sfd, buf, max_len, flags, NULL, NULL);
 }
@@ -252,11 +1080,19 @@ static int offload_sendto(int sfd, const void *buf, size_t len,
         return -EINVAL;
     }
 
-    if (len > CONFIG_N2_MAX_PACKET_SIZE)
+    if (len > CONFIG_N2_MAX_SEND_SIZE)
     {
         return -EINVAL;
     }
     int sock_fd = S_TO_I(sfd);
+    // Waits for the link unless the call is non-blocking
+    int err = socket_create(sock_fd, call_timeout(&sockets[sock_fd], flags,
+                                                  sockets[sock_fd].snd_timeout));
+    if (err != 0)
+    {
+        errno = -err;
+        return err;
+    }
     k_sem_take(&mdm_sem, K_FOREVER);
 
     struct sockaddr_in *toaddr = (struct sockaddr_in *)to;
@@ -269,29 +1105,42 @@ static int offload_sendto(int sfd, const void *buf, size_t len,
         return -EINVAL;
     }
 
-    sprintf(modem_command_buffer,
-            "AT+NSOST=%d,\"%s\",%d,%d,\"",
-            sockets[sock_fd].id, addr,
-            ntohs(toaddr->sin_port),
-            len);
-
-    modem_write(modem_command_buffer);
-
-    char byte[3];
-    for (int i = 0; i < len; i++)
+    char cmdbuf[CMD_BUFFER_SIZE];
+    if ((flags & (N2_MSG_RAI_RELEASE | N2_MSG_RAI_RELEASE_AFTER_REPLY)) != 0)
+    {
+        // Same as AT+NSOST but with a release assistance flag
+        int rai = (flags & N2_MSG_RAI_RELEASE) ? NSOSTF_RELEASE : NSOSTF_RELEASE_AFTER_REPLY;
+        sprintf(cmdbuf,
+                "AT+NSOSTF=%d,\"%s\",%d,0x%X,%d,\"",
+                sockets[sock_fd].id, addr,
+                ntohs(toaddr->sin_port),
+                rai, len);
+    }
+    else
     {
-        byte[0] = TO_HEX((((const char *)buf)[i] >> 4));
-        byte[1] = TO_HEX((((const char *)buf)[i] & 0xF));
-        byte[2] = 0;
-        modem_write(byte);
+        sprintf(cmdbuf,
+                "AT+NSOST=%d,\"%s\",%d,%d,\"",
+                sockets[sock_fd].id, addr,
+                ntohs(toaddr->sin_port),
+                len);
     }
+    k_sem_give(&mdm_sem);
 
-    modem_write("\"\r");
+    struct nsost_result res = {
+        .sockfd = -1,
+        .sent = 0,
+    };
+    struct at_cmd cmd = {
+        .cmd = cmdbuf,
+        .payload = buf,
+        .payload_len = len,
+        .suffix = "\"\r",
+        .decode = nsost_decode,
+        .ctx = &res,
+    };
 
     int written = len;
-    int fd = -1;
-    size_t sent = 0;
-    switch (atnsost_decode(&fd, &sent))
+    switch (modem_exec(&cmd))
     {
     case AT_OK:
         break;
@@ -302,7 +1151,6 @@ static int offload_sendto(int sfd, const void *buf, size_t len,
         written = -ENOMEM;
         break;
     }
-    k_sem_give(&mdm_sem);
 
     return written;
 }
@@ -321,12 +1169,118 @@ static int offload_send(int sfd, const void *buf, size_t len, int flags)
         k_sem_give(&mdm_sem);
         return -ENOTCONN;
     }
+    struct sockaddr_in to = sockets[sock_fd].remote_addr;
+    socklen_t tolen = sockets[sock_fd].remote_len;
     k_sem_give(&mdm_sem);
     int ret = offload_sendto(sfd, buf, len, flags,
-                             sockets[sock_fd].remote_addr, sockets[sock_fd].remote_len);
+                             (struct sockaddr *)&to, tolen);
     return ret;
 }
 
+static s32_t timeval_to_ms(const struct timeval *tv)
+{
+    // A zero timeout blocks forever
+    if (tv->tv_sec == 0 && tv->tv_usec == 0)
+    {
+        return K_FOREVER;
+    }
+    return tv->tv_sec * MSEC_PER_SEC + tv->tv_usec / USEC_PER_MSEC;
+}
+
+static void ms_to_timeval(s32_t ms, struct timeval *tv)
+{
+    if (ms == K_FOREVER)
+    {
+        ms = 0;
+    }
+    tv->tv_sec = ms / MSEC_PER_SEC;
+    tv->tv_usec = (ms % MSEC_PER_SEC) * USEC_PER_MSEC;
+}
+
+static int offload_setsockopt(int sfd, int level, int optname,
+                              const void *optval, socklen_t optlen)
+{
+    if (!VALID_SOCKET(sfd))
+    {
+        return -EINVAL;
+    }
+    if (level != SOL_SOCKET)
+    {
+        return -ENOPROTOOPT;
+    }
+    struct n2_socket *sock = &sockets[S_TO_I(sfd)];
+    s32_t *timeout;
+    switch (optname)
+    {
+    case SO_RCVTIMEO:
+        timeout = &sock->rcv_timeout;
+        break;
+    case SO_SNDTIMEO:
+        timeout = &sock->snd_timeout;
+        break;
+    default:
+        return -ENOPROTOOPT;
+    }
+    if (optval == NULL || optlen < sizeof(struct timeval))
+    {
+        return -EINVAL;
+    }
+    *timeout = timeval_to_ms((const struct timeval *)optval);
+    return 0;
+}
+
+static int offload_getsockopt(int sfd, int level, int optname,
+                              void *optval, socklen_t *optlen)
+{
+    if (!VALID_SOCKET(sfd))
+    {
+        return -EINVAL;
+    }
+    if (level != SOL_SOCKET)
+    {
+        return -ENOPROTOOPT;
+    }
+    struct n2_socket *sock = &sockets[S_TO_I(sfd)];
+    s32_t timeout;
+    switch (optname)
+    {
+    case SO_RCVTIMEO:
+        timeout = sock->rcv_timeout;
+        break;
+    case SO_SNDTIMEO:
+        timeout = sock->snd_timeout;
+        break;
+    default:
+        return -ENOPROTOOPT;
+    }
+    if (optval == NULL || optlen == NULL || *optlen < sizeof(struct timeval))
+    {
+        return -EINVAL;
+    }
+    ms_to_timeval(timeout, (struct timeval *)optval);
+    *optlen = sizeof(struct timeval);
+    return 0;
+}
+
+static int offload_fcntl(int sfd, int cmd, va_list args)
+{
+    if (!VALID_SOCKET(sfd))
+    {
+        return -EINVAL;
+    }
+    struct n2_socket *sock = &sockets[S_TO_I(sfd)];
+    switch (cmd)
+    {
+    case F_GETFL:
+        return sock->nonblock ? O_NONBLOCK : 0;
+    case F_SETFL:
+        sock->nonblock = (va_arg(args, int) & O_NONBLOCK) == O_NONBLOCK;
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
 static int offload_socket(int family, int type, int proto)
 {
     if (family != AF_INET)
@@ -343,42 +1297,67 @@ static int offload_socket(int family, int type, int proto)
     }
 
     k_sem_take(&mdm_sem, K_FOREVER);
+    // Prefer an idle socket from the pool, then an empty slot. Slots that
+    // are being created or drained for the pool are skipped.
     int fd = INVALID_FD;
     for (int i = 0; i < MDM_MAX_SOCKETS; i++) {
-        if (!sockets[i].in_use) {
+        if (pool_ready(&sockets[i])) {
             fd = i;
             break;
         }
+        if (fd == INVALID_FD && !sockets[i].in_use && sockets[i].id < 0 &&
+            !sockets[i].creating) {
+            fd = i;
+        }
     }
     if (fd == INVALID_FD) {
         k_sem_give(&mdm_sem);
         return -ENOMEM;
     }
-    sockets[fd].local_port = next_free_port;
-    sprintf(modem_command_buffer, "AT+NSOCR=\"DGRAM\",17,%d,1\r", sockets[fd].local_port);
-    modem_write(modem_command_buffer);
-
-    int sockfd = -1;
-    if (atnsocr_decode(&sockfd) == AT_OK)
+    sockets[fd].in_use = true;
+    sockets[fd].nonblock = false;
+    sockets[fd].rcv_timeout = K_FOREVER;
+    sockets[fd].snd_timeout = K_FOREVER;
+    if (sockets[fd].id >= 0)
     {
-        sockets[fd].id = sockfd;
-        sockets[fd].in_use = true;
-        next_free_port++;
+        // Taken from the pool. It is filled up again in the background once
+        // it runs out. Refilling right away would leave no room for the
+        // socket when it is closed, so clients that open a socket per
+        // exchange would pay for AT+NSOCL after all.
+        if (pool_count() == 0)
+        {
+            pool_fill();
+        }
         k_sem_give(&mdm_sem);
         return I_TO_S(fd);
     }
+    // The socket is created on the modem right away if the link is up.
+    // Otherwise it is created when the link comes up or on first use.
+    sockets[fd].local_port = next_free_port++;
     k_sem_give(&mdm_sem);
-    return -ENOMEM;
+
+    if (modem_link_up() && socket_create(fd, K_NO_WAIT) != 0)
+    {
+        k_sem_take(&mdm_sem, K_FOREVER);
+        clear_socket(fd);
+        k_sem_give(&mdm_sem);
+        return -ENOMEM;
+    }
+    return I_TO_S(fd);
 }
 
 // We're only interested in socket(), close(), connect(), poll()/POLLIN, send() and recvfrom()
-// since that's what the lwm2m client/coap library uses.
-// bind(), accept(), fctl(), freeaddrinfo(), getaddrinfo(), setsockopt(),
-// getsockopt() and listen() is not implemented
+// since that's what the lwm2m client/coap library uses. setsockopt() and
+// getsockopt() handle SO_RCVTIMEO and SO_SNDTIMEO and fcntl() handles
+// O_NONBLOCK. bind(), accept(), freeaddrinfo(), getaddrinfo() and listen()
+// is not implemented
 static const struct socket_offload n2_socket_offload = {
     .socket = offload_socket,
     .close = offload_close,
     .connect = offload_connect,
+    .setsockopt = offload_setsockopt,
+    .getsockopt = offload_getsockopt,
+    .fcntl = offload_fcntl,
     .poll = offload_poll,
     .recv = offload_recv,
     .recvfrom = offload_recvfrom,
@@ -406,7 +1385,8 @@ static void offload_iface_init(struct net_if *iface)
     for (int i = 0; i < MDM_MAX_SOCKETS; i++)
     {
         sockets[i].id = -1;
-        sockets[i].remote_addr = NULL;
+        sys_slist_init(&sockets[i].rx_waiters);
+        sys_slist_init(&sockets[i].rx_queue);
     }
     iface->if_dev->offload = &offload_funcs;
     socket_offload_register(&n2_socket_offload);
@@ -416,27 +1396,101 @@ static struct net_if_api api_funcs = {
     .init = offload_iface_init,
 };
 
-static void receive_cb(int fd, size_t bytes)
+/**
+ * @brief Start reads for the data announced by the URCs and handle sockets
+ *        closed by the modem. Runs on the system work queue since the URC
+ *        thread doesn't take mdm_sem.
+ */
+static void rx_work_handler(struct k_work *work)
 {
     k_sem_take(&mdm_sem, K_FOREVER);
     for (int i = 0; i < MDM_MAX_SOCKETS; i++)
     {
-        if (sockets[i].id == fd)
+        if (!atomic_cas(&sockets[i].modem_closed, 1, 0))
+        {
+            continue;
+        }
+        if (!sockets[i].in_use)
+        {
+            // Idle in the pool. Drop it so it isn't handed out. A drain in
+            // flight drops it when it completes.
+            if (sockets[i].reading)
+            {
+                sockets[i].closing = true;
+            }
+            else
+            {
+                clear_socket(i);
+            }
+        }
+        else
         {
-            sockets[i].incoming_len += bytes;
+            // The modem reuses the number for the next AT+NSOCR so forget
+            // it. The socket is created again on the next send or receive
+            // and close() doesn't put it in the pool.
+            LOG_WRN("Modem closed socket %d", sockets[i].id);
+            sockets[i].id = -1;
+            pending_clear(&sockets[i]);
+            rx_notify(&sockets[i]);
         }
     }
+    rx_prefetch_all();
     k_sem_give(&mdm_sem);
 }
 
+static struct k_work rx_work;
+
+// Runs on the modem thread. The socket ids only change with mdm_sem held
+// and the pending ring is lock-free, so this never waits.
+static void receive_cb(int fd, size_t bytes)
+{
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
+    {
+        if (sockets[i].id == fd)
+        {
+            pending_add(&sockets[i], bytes);
+            rx_notify(&sockets[i]);
+        }
+    }
+    k_work_submit(&rx_work);
+}
+
+// +NSOCLI: <socket> is sent when the modem closes a socket by itself (ie
+// when the PDP context goes away). Nothing more can be read from it.
+static void nsocli_urc(const union urc_arg *args, int count, void *ctx)
+{
+    if (count < 1)
+    {
+        return;
+    }
+    for (int i = 0; i < MDM_MAX_SOCKETS; i++)
+    {
+        if (sockets[i].id == args[0].i)
+        {
+            atomic_set(&sockets[i].modem_closed, 1);
+        }
+    }
+    k_work_submit(&rx_work);
+}
+
+static struct urc_handler nsocli_handler = {
+    .name = "+NSOCLI",
+    .format = "i",
+    .callback = nsocli_urc,
+};
+
 // _init initializes the network offloading
 static int n2_init(struct device *dev)
 {
     ARG_UNUSED(dev);
 
     k_sem_init(&mdm_sem, 1, 1);
+    k_mutex_init(&create_lock);
+    k_work_init(&rx_work, rx_work_handler);
 
     receive_callback(receive_cb);
+    link_callback(link_up_cb);
+    urc_register(&nsocli_handler);
 
     modem_init();
     return 0;
@@ -0,0 +1,16 @@
+#pragma once
+
+/*
+ * Extra flags for send() and sendto() on N2 sockets.
+ *
+ * The Release Assistance Indication (RAI) flags tell the network that the
+ * radio connection can be released instead of waiting for the inactivity
+ * timer. Sends with one of these flags use AT+NSOSTF instead of AT+NSOST.
+ * The flags are outside the range used by the MSG_* flags in Zephyr.
+ */
+
+// Release the connection after this datagram is sent
+#define N2_MSG_RAI_RELEASE 0x1000
+
+// Release the connection after the first reply to this datagram is received
+#define N2_MSG_RAI_RELEASE_AFTER_REPLY 0x2000
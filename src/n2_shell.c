@@ -0,0 +1,83 @@
+// The "n2" shell command with the driver statistics and the AT trace
+#if defined(CONFIG_SHELL)
+
+#include <zephyr.h>
+#include <shell/shell.h>
+#include "stats.h"
+#include "trace.h"
+
+static int cmd_stats(const struct shell *shell, size_t argc, char **argv)
+{
+    const struct stats *s = stats_get();
+    shell_print(shell, "UART RX: %u bytes, TX: %u bytes", s->rx_bytes, s->tx_bytes);
+    shell_print(shell, "RX overflow: %u bytes", s->rx_overflow);
+    shell_print(shell, "URCs: %u, dropped: %u", s->urcs, s->urc_dropped);
+    shell_print(shell, "Sends that woke the radio: %u", s->wakeups);
+    for (int i = 0; i < STATS_CMD_COUNT; i++)
+    {
+        const struct stats_cmd_counters *c = &s->cmd[i];
+        shell_print(shell, "%-6s count: %u, errors: %u, timeouts: %u",
+                    stats_cmd_name(i), c->count, c->errors, c->timeouts);
+        for (int b = 0; b < STATS_BUCKETS; b++)
+        {
+            if (c->latency[b] == 0)
+            {
+                continue;
+            }
+            if (b == STATS_BUCKETS - 1)
+            {
+                shell_print(shell, "    >= %5u ms: %u", stats_bucket_ms(b), c->latency[b]);
+            }
+            else
+            {
+                shell_print(shell, "    <  %5u ms: %u", stats_bucket_ms(b + 1), c->latency[b]);
+            }
+        }
+    }
+    return 0;
+}
+
+static int cmd_reset(const struct shell *shell, size_t argc, char **argv)
+{
+    stats_reset();
+    shell_print(shell, "Statistics cleared");
+    return 0;
+}
+
+#if CONFIG_N2_TRACE_SIZE > 0
+static void print_shell(void *ctx, const char *line)
+{
+    shell_print((const struct shell *)ctx, "%s", line);
+}
+
+static int cmd_trace_dump(const struct shell *shell, size_t argc, char **argv)
+{
+    trace_print(print_shell, (void *)shell);
+    return 0;
+}
+
+static int cmd_trace_clear(const struct shell *shell, size_t argc, char **argv)
+{
+    trace_clear();
+    shell_print(shell, "Trace cleared");
+    return 0;
+}
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_trace,
+                               SHELL_CMD(dump, NULL, "Print the trace for tools/n2trace.py", cmd_trace_dump),
+                               SHELL_CMD(clear, NULL, "Clear the trace", cmd_trace_clear),
+                               SHELL_SUBCMD_SET_END);
+#define TRACE_CMD SHELL_CMD(trace, &sub_trace, "AT trace", NULL),
+#else
+#define TRACE_CMD
+#endif
+
+SHELL_STATIC_SUBCMD_SET_CREATE(sub_n2,
+                               SHELL_CMD(stats, NULL, "Show driver statistics", cmd_stats),
+                               SHELL_CMD(reset, NULL, "Clear driver statistics", cmd_reset),
+                               TRACE_CMD
+                               SHELL_SUBCMD_SET_END);
+
+SHELL_CMD_REGISTER(n2, &sub_n2, "SARA-N2 driver", NULL);
+
+#endif
@@ -0,0 +1,157 @@
+// Only used by replay builds (CONFIG_N2_REPLAY). The linker drops it from the
+// others.
+#include <logging/log.h>
+LOG_MODULE_REGISTER(n2_replay, LOG_LEVEL_INF);
+
+#include <zephyr.h>
+#include <string.h>
+#include "replay.h"
+#include "hex.h"
+
+// The capture. Both the reader and the writer are the modem thread.
+static const struct replay_event *events;
+static size_t event_count;
+// The event the reader is in and the position in it
+static size_t rx_event;
+static size_t rx_pos;
+// Index after the last command written. The reader may pass commands before
+// this.
+static size_t tx_event;
+static int errors;
+
+// Longest time replay_finish() waits for the modem thread
+#define IDLE_TIMEOUT 1000
+
+// Given when the modem thread goes idle and reset when it takes a command
+static K_SEM_DEFINE(idle_sem, 0, 1);
+
+void replay_start(const struct replay_event *capture, size_t count)
+{
+    events = capture;
+    event_count = count;
+    rx_event = 0;
+    rx_pos = 0;
+    tx_event = 0;
+    errors = 0;
+    k_sem_reset(&idle_sem);
+}
+
+void replay_thread_state(bool idle)
+{
+    if (idle)
+    {
+        k_sem_give(&idle_sem);
+    }
+    else
+    {
+        k_sem_reset(&idle_sem);
+    }
+}
+
+/**
+ * @brief Find the modem output the reader is at, moving past written
+ *        commands and output that has been read.
+ * @return The event, NULL at the end or when the next command hasn't been
+ *         written yet
+ */
+static const struct replay_event *rx_current(void)
+{
+    while (rx_event < event_count)
+    {
+        const struct replay_event *e = &events[rx_event];
+        if (e->dir == REPLAY_RX && rx_pos < strlen(e->data))
+        {
+            return e;
+        }
+        if (e->dir == REPLAY_TX && rx_event >= tx_event)
+        {
+            return NULL;
+        }
+        rx_event++;
+        rx_pos = 0;
+    }
+    return NULL;
+}
+
+int replay_finish(void)
+{
+    // The caller's last command has completed but the modem thread may not
+    // have read what came after it yet
+    if (k_sem_take(&idle_sem, IDLE_TIMEOUT) != 0)
+    {
+        LOG_ERR("Modem thread didn't go idle");
+        errors++;
+    }
+    rx_current();
+    if (rx_event < event_count)
+    {
+        LOG_ERR("%d events were not replayed", event_count - rx_event);
+        errors++;
+    }
+    events = NULL;
+    event_count = 0;
+    return errors;
+}
+
+/**
+ * @brief Compare a piece of a command with the captured one.
+ */
+static bool tx_compare(const char *expected, size_t *pos, const char *data, size_t len)
+{
+    size_t n = MIN(len, strlen(expected) - *pos);
+    bool match = memcmp(expected + *pos, data, n) == 0;
+    *pos += n;
+    return match;
+}
+
+void replay_write(const char *prefix, const uint8_t *payload, size_t len, const char *suffix)
+{
+    size_t i = tx_event;
+    while (i < event_count && events[i].dir != REPLAY_TX)
+    {
+        i++;
+    }
+    if (i == event_count)
+    {
+        LOG_ERR("Command not in the capture: %s", log_strdup(prefix));
+        errors++;
+        return;
+    }
+    tx_event = i + 1;
+
+    const char *expected = events[i].data;
+    size_t pos = 0;
+    bool match = tx_compare(expected, &pos, prefix, strlen(prefix));
+    char hex[32];
+    for (size_t off = 0; off < len; off += sizeof(hex) / 2)
+    {
+        size_t n = MIN(len - off, sizeof(hex) / 2);
+        match &= tx_compare(expected, &pos, hex, hex_encode(payload + off, n, hex));
+    }
+    if (suffix)
+    {
+        match &= tx_compare(expected, &pos, suffix, strlen(suffix));
+    }
+    if (!match || pos < strlen(expected))
+    {
+        LOG_ERR("Command doesn't match the capture: %s, expected %s",
+                log_strdup(prefix), log_strdup(expected));
+        errors++;
+    }
+}
+
+size_t replay_read_claim(uint8_t **data, size_t max)
+{
+    const struct replay_event *e = rx_current();
+    if (!e)
+    {
+        return 0;
+    }
+    *data = (uint8_t *)e->data + rx_pos;
+    return MIN(max, strlen(e->data) - rx_pos);
+}
+
+void replay_read_finish(size_t len)
+{
+    rx_pos += len;
+}
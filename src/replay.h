@@ -0,0 +1,79 @@
+#pragma once
+
+#include <zephyr.h>
+
+/*
+ * Replay of captured modem output. In replay builds (CONFIG_N2_REPLAY, see
+ * "make replay") comms.c doesn't use the UART: modem_read_claim() returns the
+ * captured modem output and the commands the driver writes are checked
+ * against the captured commands. Everything above that (the modem thread,
+ * the AT tokenizer and decoders and the URC dispatcher) runs as usual, so
+ * real modem output can be used as a deterministic test without hardware.
+ *
+ * Captures can be converted from trace dumps and logic analyser exports with
+ * tools/n2capture.py.
+ */
+
+enum replay_dir
+{
+    // Written by the driver
+    REPLAY_TX,
+    // Sent by the modem
+    REPLAY_RX,
+};
+
+/**
+ * @brief A chunk of captured traffic
+ */
+struct replay_event
+{
+    enum replay_dir dir;
+    const char *data;
+};
+
+/**
+ * @brief Start replaying a capture. The modem output is made available in
+ *        the order it was captured, but output captured after a command is
+ *        held back until the driver has written that command. Reads that run
+ *        out of output return right away, as if the UART had timed out.
+ * @param *events: The capture. It must stay valid until replay_finish().
+ * @param count: Number of events
+ */
+void replay_start(const struct replay_event *events, size_t count);
+
+/**
+ * @brief Stop replaying. Waits until the modem thread has run out of
+ *        commands and has read the output that follows the last one (ie
+ *        URCs after the final OK).
+ * @return Number of problems: commands that didn't match the capture, or
+ *         events that were never replayed.
+ */
+int replay_finish(void);
+
+/**
+ * @brief Called by the modem thread when it takes a command and when it is
+ *        idle, after it has read the available output.
+ * @param idle: True if there are no commands
+ */
+void replay_thread_state(bool idle);
+
+/**
+ * @brief Check a command the driver writes against the capture. The command
+ *        is compared up to the length of the captured one so captures with
+ *        truncated commands (ie from the trace) can be used.
+ * @param *prefix: The command up to the payload
+ * @param *payload: Binary payload, sent as hex. May be NULL.
+ * @param len: Length of the payload
+ * @param *suffix: The rest of the command after the payload. May be NULL.
+ */
+void replay_write(const char *prefix, const uint8_t *payload, size_t len, const char *suffix);
+
+/**
+ * @brief Replay version of modem_read_claim(). Never waits.
+ */
+size_t replay_read_claim(uint8_t **data, size_t max);
+
+/**
+ * @brief Replay version of modem_read_finish()
+ */
+void replay_read_finish(size_t len);
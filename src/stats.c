@@ -0,0 +1,113 @@
+#include <zephyr.h>
+#include <string.h>
+#include "stats.h"
+#include "at_commands.h"
+
+static struct stats stats;
+
+static const char *cmd_names[STATS_CMD_COUNT] = {
+    [STATS_CMD_NSOST] = "NSOST",
+    [STATS_CMD_NSORF] = "NSORF",
+    [STATS_CMD_NSOCR] = "NSOCR",
+    [STATS_CMD_NSOCL] = "NSOCL",
+    [STATS_CMD_OTHER] = "other",
+};
+
+const struct stats *stats_get(void)
+{
+    return &stats;
+}
+
+void stats_reset(void)
+{
+    unsigned int key = irq_lock();
+    memset(&stats, 0, sizeof(stats));
+    irq_unlock(key);
+}
+
+const char *stats_cmd_name(enum stats_cmd cmd)
+{
+    return cmd_names[cmd];
+}
+
+uint32_t stats_bucket_ms(int bucket)
+{
+    return bucket == 0 ? 0 : 1U << (bucket - 1);
+}
+
+void stats_rx(size_t len, size_t dropped)
+{
+    stats.rx_bytes += len;
+    stats.rx_overflow += dropped;
+}
+
+void stats_tx(size_t len)
+{
+    stats.tx_bytes += len;
+}
+
+void stats_urc(bool dropped)
+{
+    if (dropped)
+    {
+        stats.urc_dropped++;
+        return;
+    }
+    stats.urcs++;
+}
+
+static enum stats_cmd classify(const char *cmd)
+{
+    // NSOSTF shares the counters with NSOST
+    if (strncmp(cmd, "AT+NSOST", 8) == 0)
+    {
+        return STATS_CMD_NSOST;
+    }
+    if (strncmp(cmd, "AT+NSORF", 8) == 0)
+    {
+        return STATS_CMD_NSORF;
+    }
+    if (strncmp(cmd, "AT+NSOCR", 8) == 0)
+    {
+        return STATS_CMD_NSOCR;
+    }
+    if (strncmp(cmd, "AT+NSOCL", 8) == 0)
+    {
+        return STATS_CMD_NSOCL;
+    }
+    return STATS_CMD_OTHER;
+}
+
+static int bucket(uint32_t ms)
+{
+    int b = 0;
+    while (ms > 0 && b < STATS_BUCKETS - 1)
+    {
+        ms >>= 1;
+        b++;
+    }
+    return b;
+}
+
+void stats_wakeup(const char *cmd)
+{
+    if (classify(cmd) == STATS_CMD_NSOST)
+    {
+        stats.wakeups++;
+    }
+}
+
+void stats_cmd(const char *cmd, int result, uint32_t ms)
+{
+    struct stats_cmd_counters *c = &stats.cmd[classify(cmd)];
+    c->count++;
+    if (result == AT_TIMEOUT)
+    {
+        c->timeouts++;
+    }
+    else if (result != AT_OK)
+    {
+        c->errors++;
+    }
+    c->latency[bucket(ms)]++;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include <zephyr.h>
+
+/*
+ * Driver statistics. The counters are updated by the RX path and the modem
+ * thread and can be read from the shell ("n2 stats") and the LwM2M
+ * statistics object. Each counter has a single writer so they aren't locked.
+ * The writers are the UART interrupt and cooperative threads, so
+ * stats_reset() only has to lock interrupts.
+ */
+
+/**
+ * @brief Commands with their own counters and latency histogram. Anything
+ *        else is counted as STATS_CMD_OTHER.
+ */
+enum stats_cmd
+{
+    // AT+NSOST and AT+NSOSTF
+    STATS_CMD_NSOST,
+    STATS_CMD_NSORF,
+    STATS_CMD_NSOCR,
+    STATS_CMD_NSOCL,
+    STATS_CMD_OTHER,
+    STATS_CMD_COUNT,
+};
+
+// Latency buckets. Bucket 0 is below 1 ms, bucket n (n > 0) is
+// [2^(n-1), 2^n) ms and the last bucket has everything above.
+#define STATS_BUCKETS 16
+
+struct stats_cmd_counters
+{
+    // Completed commands, whatever the result
+    uint32_t count;
+    uint32_t errors;
+    uint32_t timeouts;
+    uint32_t latency[STATS_BUCKETS];
+};
+
+struct stats
+{
+    // Bytes over the UART in each direction
+    uint32_t rx_bytes;
+    uint32_t tx_bytes;
+    // Bytes dropped because the RX ring buffer was full
+    uint32_t rx_overflow;
+    // URCs dispatched to a handler and URC lines lost because they never
+    // completed. Lines nothing is registered for aren't counted.
+    uint32_t urcs;
+    uint32_t urc_dropped;
+    // Sends written while the radio was idle or in PSM, ie sends that had to
+    // wake it up
+    uint32_t wakeups;
+    struct stats_cmd_counters cmd[STATS_CMD_COUNT];
+};
+
+/**
+ * @brief The current counters.
+ */
+const struct stats *stats_get(void);
+
+/**
+ * @brief Clear all counters.
+ */
+void stats_reset(void);
+
+/**
+ * @brief Short name of a command, ie "NSOST"
+ */
+const char *stats_cmd_name(enum stats_cmd cmd);
+
+/**
+ * @brief Lower bound in ms of a latency bucket
+ */
+uint32_t stats_bucket_ms(int bucket);
+
+/**
+ * @brief Count a burst of received bytes.
+ * @param len: Bytes received
+ * @param dropped: Bytes that didn't fit in the RX ring buffer
+ */
+void stats_rx(size_t len, size_t dropped);
+
+/**
+ * @brief Count bytes written to the modem.
+ */
+void stats_tx(size_t len);
+
+/**
+ * @brief Count a URC line.
+ * @param dropped: True if the line was lost before it completed, false if
+ *        it was dispatched to a handler
+ */
+void stats_urc(bool dropped);
+
+/**
+ * @brief Count a command written while the radio wasn't connected. Only
+ *        sends are counted.
+ * @param *cmd: The command string
+ */
+void stats_wakeup(const char *cmd);
+
+/**
+ * @brief Count a completed AT command.
+ * @param *cmd: The command string, used to find its counters
+ * @param result: AT_OK, AT_ERROR or AT_TIMEOUT
+ * @param ms: Time from when the command was written until the response was
+ *        decoded
+ */
+void stats_cmd(const char *cmd, int result, uint32_t ms);
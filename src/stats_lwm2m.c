@@ -0,0 +1,137 @@
+// LwM2M object with the driver statistics. There's no public API for custom
+// objects so this uses the engine headers from subsys/net/lib/lwm2m, the
+// same way the engine's own objects are defined.
+#if defined(CONFIG_LWM2M)
+
+#include <zephyr.h>
+#include <init.h>
+#include <stdio.h>
+#include <logging/log.h>
+#include "lwm2m_object.h"
+#include "lwm2m_engine.h"
+#include "config.h"
+#include "stats.h"
+
+LOG_MODULE_REGISTER(n2_stats, LOG_LEVEL_INF);
+
+// Resources. Each command has a block of four resources starting at
+// CMD_RES(cmd).
+#define RX_BYTES_ID 0
+#define TX_BYTES_ID 1
+#define RX_OVERFLOW_ID 2
+#define URCS_ID 3
+#define URC_DROPPED_ID 4
+#define RESET_ID 5
+#define WAKEUPS_ID 6
+#define CMD_RES(cmd) (10 * ((cmd) + 1))
+#define CMD_COUNT_ID 0
+#define CMD_ERRORS_ID 1
+#define CMD_TIMEOUTS_ID 2
+// The latency histogram as a string of STATS_BUCKETS comma separated counts
+#define CMD_LATENCY_ID 3
+
+#define CMD_FIELDS(cmd)                                                   \
+    OBJ_FIELD_DATA(CMD_RES(cmd) + CMD_COUNT_ID, R, U32),                  \
+        OBJ_FIELD_DATA(CMD_RES(cmd) + CMD_ERRORS_ID, R, U32),             \
+        OBJ_FIELD_DATA(CMD_RES(cmd) + CMD_TIMEOUTS_ID, R, U32),           \
+        OBJ_FIELD_DATA(CMD_RES(cmd) + CMD_LATENCY_ID, R, STRING)
+
+static struct lwm2m_engine_obj_field fields[] = {
+    OBJ_FIELD_DATA(RX_BYTES_ID, R, U32),
+    OBJ_FIELD_DATA(TX_BYTES_ID, R, U32),
+    OBJ_FIELD_DATA(RX_OVERFLOW_ID, R, U32),
+    OBJ_FIELD_DATA(URCS_ID, R, U32),
+    OBJ_FIELD_DATA(URC_DROPPED_ID, R, U32),
+    OBJ_FIELD_EXECUTE(RESET_ID),
+    OBJ_FIELD_DATA(WAKEUPS_ID, R, U32),
+    CMD_FIELDS(STATS_CMD_NSOST),
+    CMD_FIELDS(STATS_CMD_NSORF),
+    CMD_FIELDS(STATS_CMD_NSOCR),
+    CMD_FIELDS(STATS_CMD_NSOCL),
+    CMD_FIELDS(STATS_CMD_OTHER),
+};
+
+// Everything but the reset has a single resource instance
+#define RES_COUNT ARRAY_SIZE(fields)
+#define RES_INST_COUNT (RES_COUNT - 1)
+
+static struct lwm2m_engine_obj stats_obj;
+static struct lwm2m_engine_obj_inst inst;
+static struct lwm2m_engine_res res[RES_COUNT];
+static struct lwm2m_engine_res_inst res_inst[RES_INST_COUNT];
+
+// Formatted on every read. The engine writes each resource out before it
+// reads the next so one buffer is enough.
+static char latency_buf[STATS_BUCKETS * 11];
+
+static void *latency_read_cb(u16_t obj_inst_id, u16_t res_id, u16_t res_inst_id, size_t *data_len)
+{
+    const struct stats_cmd_counters *c = &stats_get()->cmd[res_id / 10 - 1];
+    size_t pos = 0;
+    for (int b = 0; b < STATS_BUCKETS; b++)
+    {
+        pos += snprintf(latency_buf + pos, sizeof(latency_buf) - pos,
+                        b == 0 ? "%u" : ",%u", c->latency[b]);
+    }
+    *data_len = pos;
+    return latency_buf;
+}
+
+static int reset_cb(u16_t obj_inst_id)
+{
+    stats_reset();
+    return 0;
+}
+
+static struct lwm2m_engine_obj_inst *stats_create(u16_t obj_inst_id)
+{
+    // The engine only reads the counters, they're never written through it
+    struct stats *s = (struct stats *)stats_get();
+    int i = 0, j = 0;
+
+    init_res_instance(res_inst, ARRAY_SIZE(res_inst));
+
+    INIT_OBJ_RES_DATA(RX_BYTES_ID, res, i, res_inst, j, &s->rx_bytes, sizeof(s->rx_bytes));
+    INIT_OBJ_RES_DATA(TX_BYTES_ID, res, i, res_inst, j, &s->tx_bytes, sizeof(s->tx_bytes));
+    INIT_OBJ_RES_DATA(RX_OVERFLOW_ID, res, i, res_inst, j, &s->rx_overflow, sizeof(s->rx_overflow));
+    INIT_OBJ_RES_DATA(URCS_ID, res, i, res_inst, j, &s->urcs, sizeof(s->urcs));
+    INIT_OBJ_RES_DATA(URC_DROPPED_ID, res, i, res_inst, j, &s->urc_dropped, sizeof(s->urc_dropped));
+    INIT_OBJ_RES_EXECUTE(RESET_ID, res, i, reset_cb);
+    INIT_OBJ_RES_DATA(WAKEUPS_ID, res, i, res_inst, j, &s->wakeups, sizeof(s->wakeups));
+    for (int cmd = 0; cmd < STATS_CMD_COUNT; cmd++)
+    {
+        struct stats_cmd_counters *c = &s->cmd[cmd];
+        INIT_OBJ_RES_DATA(CMD_RES(cmd) + CMD_COUNT_ID, res, i, res_inst, j, &c->count, sizeof(c->count));
+        INIT_OBJ_RES_DATA(CMD_RES(cmd) + CMD_ERRORS_ID, res, i, res_inst, j, &c->errors, sizeof(c->errors));
+        INIT_OBJ_RES_DATA(CMD_RES(cmd) + CMD_TIMEOUTS_ID, res, i, res_inst, j, &c->timeouts, sizeof(c->timeouts));
+        INIT_OBJ_RES_DATA(CMD_RES(cmd) + CMD_LATENCY_ID, res, i, res_inst, j, latency_buf, sizeof(latency_buf));
+        res[i - 1].read_cb = latency_read_cb;
+    }
+
+    inst.resources = res;
+    inst.resource_count = i;
+    return &inst;
+}
+
+static int stats_lwm2m_init(struct device *dev)
+{
+    struct lwm2m_engine_obj_inst *obj_inst = NULL;
+
+    stats_obj.obj_id = CONFIG_N2_STATS_OBJ_ID;
+    stats_obj.fields = fields;
+    stats_obj.field_count = ARRAY_SIZE(fields);
+    stats_obj.max_instance_count = 1U;
+    stats_obj.create_cb = stats_create;
+    lwm2m_register_obj(&stats_obj);
+
+    int ret = lwm2m_create_obj_inst(CONFIG_N2_STATS_OBJ_ID, 0, &obj_inst);
+    if (ret < 0)
+    {
+        LOG_ERR("Create statistics object instance error: %d", ret);
+    }
+    return ret;
+}
+
+SYS_INIT(stats_lwm2m_init, APPLICATION, CONFIG_KERNEL_INIT_PRIORITY_DEFAULT);
+
+#endif
@@ -0,0 +1,144 @@
+#include "config.h"
+#include <logging/log.h>
+#define LOG_LEVEL APP_LOG_LEVEL
+LOG_MODULE_REGISTER(hex_test);
+
+#include <zephyr.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hex.h"
+#include "test_hex.h"
+
+// The conversions the driver used before the table driven codec. Kept here
+// as the reference for validation and as the benchmark baseline.
+#define TO_HEX(i) (i <= 9 ? '0' + i : 'A' - 10 + i)
+#define FROM_HEX(x) (x - '0' > 9 ? x - 'A' + 10 : x - '0')
+
+#define BENCH_SIZE 512
+#define BENCH_RUNS 200
+
+static uint8_t bin[BENCH_SIZE];
+static uint8_t decoded[BENCH_SIZE];
+static char hex[BENCH_SIZE * 2];
+static char ref[BENCH_SIZE * 2];
+
+static void ref_encode(const uint8_t *data, size_t len, char *out)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        out[i * 2] = TO_HEX((data[i] >> 4));
+        out[i * 2 + 1] = TO_HEX((data[i] & 0xF));
+    }
+}
+
+static void ref_decode(const char *in, size_t len, uint8_t *out)
+{
+    for (size_t i = 0; i < len; i += 2)
+    {
+        out[i / 2] = (FROM_HEX(in[i]) << 4 | FROM_HEX(in[i + 1]));
+    }
+}
+
+static bool validate()
+{
+    // Every byte value, then odd and even lengths of random data
+    for (int i = 0; i < 256; i++)
+    {
+        bin[i] = i;
+    }
+    for (int len = 0; len <= BENCH_SIZE; len += (len < 256 ? 1 : 37))
+    {
+        if (len > 256)
+        {
+            for (int i = 0; i < len; i++)
+            {
+                bin[i] = rand();
+            }
+        }
+        ref_encode(bin, len, ref);
+        if (hex_encode(bin, len, hex) != len * 2 || memcmp(hex, ref, len * 2) != 0)
+        {
+            LOG_ERR("hex_encode mismatch for %d bytes", len);
+            return false;
+        }
+        if (hex_decode(hex, len * 2, decoded) != len || memcmp(decoded, bin, len) != 0)
+        {
+            LOG_ERR("hex_decode mismatch for %d bytes", len);
+            return false;
+        }
+        ref_decode(hex, len * 2, decoded);
+        if (memcmp(decoded, bin, len) != 0)
+        {
+            LOG_ERR("Reference decoder mismatch for %d bytes", len);
+            return false;
+        }
+    }
+    // Lower case isn't handled by the old decoder but the modem might use it
+    if (hex_decode("0aBcdEf9", 8, decoded) != 4 ||
+        decoded[0] != 0x0A || decoded[1] != 0xBC || decoded[2] != 0xDE || decoded[3] != 0xF9)
+    {
+        LOG_ERR("hex_decode doesn't handle lower case digits");
+        return false;
+    }
+    if (hex_decode("0G", 2, decoded) != -1 || hex_decode("ABC", 3, decoded) != -1)
+    {
+        LOG_ERR("hex_decode accepts invalid input");
+        return false;
+    }
+    return true;
+}
+
+static u32_t to_ns_per_byte(u32_t cycles)
+{
+    return (u64_t)cycles * 1000000000 / sys_clock_hw_cycles_per_sec() / (BENCH_SIZE * BENCH_RUNS);
+}
+
+void testHex()
+{
+    if (!validate())
+    {
+        printf("Hex codec validation failed\n");
+        return;
+    }
+    printf("Hex codec validated\n");
+
+    for (int i = 0; i < BENCH_SIZE; i++)
+    {
+        bin[i] = rand();
+    }
+
+    u32_t start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        ref_encode(bin, BENCH_SIZE, ref);
+    }
+    u32_t ref_enc = k_cycle_get_32() - start;
+
+    start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        hex_encode(bin, BENCH_SIZE, hex);
+    }
+    u32_t enc = k_cycle_get_32() - start;
+
+    start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        ref_decode(hex, BENCH_SIZE * 2, decoded);
+    }
+    u32_t ref_dec = k_cycle_get_32() - start;
+
+    start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        hex_decode(hex, BENCH_SIZE * 2, decoded);
+    }
+    u32_t dec = k_cycle_get_32() - start;
+
+    printf("Hex encode: %u cycles (%u ns/byte), reference %u cycles (%u ns/byte)\n",
+           enc, to_ns_per_byte(enc), ref_enc, to_ns_per_byte(ref_enc));
+    printf("Hex decode: %u cycles (%u ns/byte), reference %u cycles (%u ns/byte)\n",
+           dec, to_ns_per_byte(dec), ref_dec, to_ns_per_byte(ref_dec));
+}
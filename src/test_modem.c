@@ -19,6 +19,40 @@ static void recv_cb(int sockfd, size_t len)
     received = len;
 }
 
+// The modem thread is the only reader of the modem output so the commands
+// are sent through it.
+static int nsocr_decode(struct at_cmd *cmd)
+{
+    return atnsocr_decode((int *)cmd->ctx);
+}
+
+struct nsost_result
+{
+    int fd;
+    size_t size;
+};
+
+static int nsost_decode(struct at_cmd *cmd)
+{
+    struct nsost_result *r = (struct nsost_result *)cmd->ctx;
+    return atnsost_decode(&r->fd, &r->size);
+}
+
+struct nsorf_result
+{
+    int sockfd;
+    char ip[32];
+    int port;
+    char data[34];
+    size_t received;
+    size_t remaining;
+};
+
+static int nsorf_decode(struct at_cmd *cmd)
+{
+    struct nsorf_result *r = (struct nsorf_result *)cmd->ctx;
+    return atnsorf_decode(&r->sockfd, r->ip, &r->port, (uint8_t *)r->data, &r->received, &r->remaining);
+}
 
 void testModem()
 {
@@ -26,43 +60,57 @@ void testModem()
 
     receive_callback(recv_cb);
 
-    modem_write("AT+NSOCR=\"DGRAM\",17,6001,1\r");
-    if (atnsocr_decode(&sockfd) != AT_OK)
+    struct at_cmd nsocr = {
+        .cmd = "AT+NSOCR=\"DGRAM\",17,6001,1\r",
+        .decode = nsocr_decode,
+        .ctx = &sockfd,
+    };
+    if (modem_exec(&nsocr) != AT_OK)
     {
         LOG_ERR("Unable to decode nsocr");
         return;
     }
-    modem_write("ATI\r");
-    atnsocl_decode();
+    struct at_cmd ati = {
+        .cmd = "ATI\r",
+    };
+    modem_exec(&ati);
 
-    modem_write("AT+NSOST=0,\"172.16.15.14\",1234,6,\"AABBAAAABBAA\"\r");
-    int fd = -1;
-    size_t size = 0;
-    if (atnsost_decode(&fd, &size) != AT_OK)
+    struct nsost_result sent = {
+        .fd = -1,
+        .size = 0,
+    };
+    struct at_cmd nsost = {
+        .cmd = "AT+NSOST=0,\"172.16.15.14\",1234,6,\"AABBAAAABBAA\"\r",
+        .decode = nsost_decode,
+        .ctx = &sent,
+    };
+    if (modem_exec(&nsost) != AT_OK)
     {
         LOG_ERR("NSOS sent error nsost");
         return;
     }
-    LOG_INF("Message sent (fd=%d,len=%d), waiting for response", fd, size);
+    LOG_INF("Message sent (fd=%d,len=%d), waiting for response", sent.fd, sent.size);
 
     while (received == 0)
     {
         k_sleep(1000);
     }
-    char ip[32];
-    char data[34];
-    int port;
-    memset(data, 0, sizeof(data));
-    size_t received;
-    size_t remaining;
-    modem_write("AT+NSORF=0,32\r");
-    if (atnsorf_decode(&sockfd, (char *)&ip, &port, (uint8_t *)&data, &received, &remaining) != AT_OK)
+    struct nsorf_result res;
+    memset(&res, 0, sizeof(res));
+    struct at_cmd nsorf = {
+        .cmd = "AT+NSORF=0,32\r",
+        .decode = nsorf_decode,
+        .ctx = &res,
+    };
+    if (modem_exec(&nsorf) != AT_OK)
     {
         LOG_ERR("Unable to decode nsorf");
     }
 
-    modem_write("AT+NSOCL=0\r");
-    if (atnsocl_decode() != AT_OK)
+    struct at_cmd nsocl = {
+        .cmd = "AT+NSOCL=0\r",
+    };
+    if (modem_exec(&nsocl) != AT_OK)
     {
         LOG_ERR("Unable to decode nsocl");
     }
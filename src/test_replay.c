@@ -0,0 +1,241 @@
+#include "config.h"
+#include <logging/log.h>
+#define LOG_LEVEL APP_LOG_LEVEL
+LOG_MODULE_REGISTER(replay_test);
+
+#include <zephyr.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "comms.h"
+#include "at_commands.h"
+#include "replay.h"
+#include "stats.h"
+#include "test_replay.h"
+
+#define BENCH_RUNS 100
+
+// Modem output as the module sends it. The events are split where the
+// module paused so the parsers see the same spans they do on the UART.
+
+// URCs before, in the middle of and after a NSORF response
+static const struct replay_event nsorf_urcs[] = {
+    {REPLAY_TX, "AT+NSORF=0,512\r"},
+    {REPLAY_RX, "\r\n+NSONMI: 0,12\r\n"},
+    {REPLAY_RX, "\r\n0,\"172.16.15.14\",1234,12,\"48656C6C6F2C20776F726C64\",0\r\n"},
+    {REPLAY_RX, "\r\n+CSCON: 0\r\n\r\nOK\r\n"},
+    {REPLAY_RX, "\r\n+CEREG: 1\r\n"},
+};
+
+// AT+NSORF sent before +NSONMI arrived. The module leaves out the address,
+// port and length; the URC follows the response.
+static const struct replay_event nsorf_short[] = {
+    {REPLAY_TX, "AT+NSORF=1,512\r"},
+    {REPLAY_RX, "\r\n1,48656C6C6F,0\r\n\r\nOK\r\n"},
+    {REPLAY_RX, "\r\n+NSONMI: 1,5\r\n"},
+};
+
+// A URC and a line split in the middle of the payload
+static const struct replay_event nsorf_split[] = {
+    {REPLAY_TX, "AT+NSORF=2,512\r"},
+    {REPLAY_RX, "\r\n+CSCON: 1\r\n\r\n2,\"172.16.15.14\",1234,4,\"DEA"},
+    {REPLAY_RX, "DBEEF\",3\r"},
+    {REPLAY_RX, "\n\r\nOK\r\n"},
+};
+
+// Socket creation with a URC in the response, a send that fails and a close
+// that never gets a response
+static const struct replay_event socket_errors[] = {
+    {REPLAY_TX, "AT+NSOCR=\"DGRAM\",17,6001,1\r"},
+    {REPLAY_RX, "\r\n+CEREG: 5\r\n\r\n3\r\n\r\nOK\r\n"},
+    {REPLAY_TX, "AT+NSOST=3,\"172.16.15.14\",1234,2,\"AA55\"\r"},
+    {REPLAY_RX, "\r\n+CME ERROR: 159\r\n"},
+    {REPLAY_TX, "AT+NSOCL=3\r"},
+};
+
+struct nsorf_result
+{
+    int sockfd;
+    char ip[AT_ADDRESS_SIZE];
+    int port;
+    uint8_t data[AT_NSORF_MAX_DATA];
+    size_t received;
+    size_t remaining;
+};
+
+struct nsorf_expected
+{
+    int sockfd;
+    const char *ip;
+    int port;
+    const char *data;
+    size_t received;
+    size_t remaining;
+    // URCs dispatched during the replay
+    uint32_t urcs;
+};
+
+static struct nsorf_result nsorf_res;
+
+static int nsorf_decode(struct at_cmd *cmd)
+{
+    struct nsorf_result *r = (struct nsorf_result *)cmd->ctx;
+    return atnsorf_decode(&r->sockfd, r->ip, &r->port, r->data, &r->received, &r->remaining);
+}
+
+static int nsocr_decode(struct at_cmd *cmd)
+{
+    return atnsocr_decode((int *)cmd->ctx);
+}
+
+static int nsost_decode(struct at_cmd *cmd)
+{
+    int fd;
+    size_t sent;
+    return atnsost_decode(&fd, &sent);
+}
+
+/**
+ * @brief Replay a capture with a single AT+NSORF and check the result.
+ */
+static bool replay_nsorf(const char *name, const struct replay_event *capture, size_t count,
+                         const struct nsorf_expected *expected)
+{
+    memset(&nsorf_res, 0, sizeof(nsorf_res));
+    struct at_cmd nsorf = {
+        .cmd = capture[0].data,
+        .decode = nsorf_decode,
+        .ctx = &nsorf_res,
+    };
+    uint32_t start_urcs = stats_get()->urcs;
+
+    replay_start(capture, count);
+    int ret = modem_exec(&nsorf);
+    int errors = replay_finish();
+
+    struct nsorf_result *r = &nsorf_res;
+    if (ret != AT_OK || errors != 0 ||
+        r->sockfd != expected->sockfd || strcmp(r->ip, expected->ip) != 0 ||
+        r->port != expected->port || r->received != expected->received ||
+        r->remaining != expected->remaining ||
+        memcmp(r->data, expected->data, expected->received) != 0 ||
+        stats_get()->urcs - start_urcs != expected->urcs)
+    {
+        printf("Replay %s failed: result %d, %d errors, socket %d, %s:%d, %d bytes, %d remaining, %d URCs\n",
+               name, ret, errors, r->sockfd, r->ip, r->port, r->received, r->remaining,
+               stats_get()->urcs - start_urcs);
+        return false;
+    }
+    return true;
+}
+
+static bool replay_socket_errors(void)
+{
+    int sockfd = -1;
+    struct at_cmd nsocr = {
+        .cmd = "AT+NSOCR=\"DGRAM\",17,6001,1\r",
+        .decode = nsocr_decode,
+        .ctx = &sockfd,
+    };
+    const uint8_t payload[] = {0xAA, 0x55};
+    struct at_cmd nsost = {
+        .cmd = "AT+NSOST=3,\"172.16.15.14\",1234,2,\"",
+        .payload = payload,
+        .payload_len = sizeof(payload),
+        .suffix = "\"\r",
+        .decode = nsost_decode,
+    };
+    struct at_cmd nsocl = {
+        .cmd = "AT+NSOCL=3\r",
+    };
+
+    replay_start(socket_errors, ARRAY_SIZE(socket_errors));
+    int created = modem_exec(&nsocr);
+    int sent = modem_exec(&nsost);
+    // Replayed reads don't wait so this times out right away
+    int closed = modem_exec(&nsocl);
+    int errors = replay_finish();
+
+    if (created != AT_OK || sockfd != 3 || sent != AT_ERROR || closed != AT_TIMEOUT || errors != 0)
+    {
+        printf("Replay socket errors failed: NSOCR %d (socket %d), NSOST %d, NSOCL %d, %d errors\n",
+               created, sockfd, sent, closed, errors);
+        return false;
+    }
+    return true;
+}
+
+static bool replay_all(void)
+{
+    static const struct nsorf_expected urcs = {
+        .sockfd = 0,
+        .ip = "172.16.15.14",
+        .port = 1234,
+        .data = "Hello, world",
+        .received = 12,
+        .remaining = 0,
+        .urcs = 3,
+    };
+    static const struct nsorf_expected short_reply = {
+        .sockfd = 1,
+        .ip = "",
+        .port = 0,
+        .data = "Hello",
+        .received = 5,
+        .remaining = 0,
+        .urcs = 1,
+    };
+    static const struct nsorf_expected split = {
+        .sockfd = 2,
+        .ip = "172.16.15.14",
+        .port = 1234,
+        .data = "\xDE\xAD\xBE\xEF",
+        .received = 4,
+        .remaining = 3,
+        .urcs = 1,
+    };
+    return replay_nsorf("NSORF with URCs", nsorf_urcs, ARRAY_SIZE(nsorf_urcs), &urcs) &&
+           replay_nsorf("short NSORF", nsorf_short, ARRAY_SIZE(nsorf_short), &short_reply) &&
+           replay_nsorf("split NSORF", nsorf_split, ARRAY_SIZE(nsorf_split), &split) &&
+           replay_socket_errors();
+}
+
+static size_t capture_size(const struct replay_event *capture, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (capture[i].dir == REPLAY_RX)
+        {
+            size += strlen(capture[i].data);
+        }
+    }
+    return size;
+}
+
+void testReplay()
+{
+    if (!replay_all())
+    {
+        return;
+    }
+    printf("Replayed captures parsed correctly\n");
+
+    // The time includes the hand-off to the modem thread for each command
+    size_t bytes = capture_size(nsorf_urcs, ARRAY_SIZE(nsorf_urcs)) +
+                   capture_size(nsorf_short, ARRAY_SIZE(nsorf_short)) +
+                   capture_size(nsorf_split, ARRAY_SIZE(nsorf_split)) +
+                   capture_size(socket_errors, ARRAY_SIZE(socket_errors));
+    u32_t start = k_cycle_get_32();
+    for (int i = 0; i < BENCH_RUNS; i++)
+    {
+        if (!replay_all())
+        {
+            return;
+        }
+    }
+    u32_t cycles = k_cycle_get_32() - start;
+    printf("Replayed %u bytes of modem output %d times: %u cycles (%u ns/byte)\n",
+           bytes, BENCH_RUNS, cycles,
+           (u32_t)((u64_t)cycles * 1000000000 / sys_clock_hw_cycles_per_sec() / (bytes * BENCH_RUNS)));
+}
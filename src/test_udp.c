@@ -1,7 +1,12 @@
 #include "config.h"
 #include <zephyr.h>
 #include <stdio.h>
+#include <errno.h>
+#include <sys/time.h>
 #include <net/socket.h>
+#include "comms.h"
+#include "at_commands.h"
+#include "stats.h"
 #include "test_udp.h"
 
 #define MDM_MAX_SOCKETS 7
@@ -146,4 +151,285 @@ void testUDP()
     close_sockets();
 
     printf("UDP test complete\n");
-}
\ No newline at end of file
+}
+
+#define CHURN_ROUNDS 20
+// Local port for the sockets created without the pool
+#define CHURN_PORT 9000
+
+static int nsocr_decode(struct at_cmd *cmd)
+{
+    return atnsocr_decode((int *)cmd->ctx);
+}
+
+/**
+ * @brief Create and close a socket on the modem directly, which is what
+ *        socket() and close() cost without the pool.
+ * @return Total time in ms, -1 on error
+ */
+static s64_t churn_unpooled(void)
+{
+    char cmdbuf[32];
+    s64_t start = k_uptime_get();
+    for (int i = 0; i < CHURN_ROUNDS; i++)
+    {
+        int fd = -1;
+        sprintf(cmdbuf, "AT+NSOCR=\"DGRAM\",17,%d,1\r", CHURN_PORT);
+        struct at_cmd nsocr = {
+            .cmd = cmdbuf,
+            .decode = nsocr_decode,
+            .ctx = &fd,
+        };
+        if (modem_exec(&nsocr) != AT_OK)
+        {
+            return -1;
+        }
+        sprintf(cmdbuf, "AT+NSOCL=%d\r", fd);
+        struct at_cmd nsocl = {
+            .cmd = cmdbuf,
+        };
+        if (modem_exec(&nsocl) != AT_OK)
+        {
+            return -1;
+        }
+    }
+    return k_uptime_get() - start;
+}
+
+// Open a socket, send a datagram, wait for the echo and close it again, the
+// way a CoAP client that uses a socket per exchange does. socket() and
+// close() are timed separately from the exchange; with the socket pool
+// (CONFIG_N2_SOCKET_POOL_SIZE) they don't talk to the modem and must take
+// less than half of what AT+NSOCR and AT+NSOCL take.
+void testUDPChurn()
+{
+    struct sockaddr_in remote_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(1234),
+    };
+    net_addr_pton(AF_INET, "172.16.15.14", &remote_addr.sin_addr);
+
+    s64_t open_ms = 0;
+    s64_t close_ms = 0;
+    s64_t exchange_ms = 0;
+    int errors = 0;
+    printf("Socket churn, %d rounds\n", CHURN_ROUNDS);
+    for (int i = 0; i < CHURN_ROUNDS; i++)
+    {
+        s64_t start = k_uptime_get();
+        int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+        open_ms += k_uptime_get() - start;
+        if (sock < 0)
+        {
+            printf("Socket churn failed: error opening socket: %d\n", sock);
+            return;
+        }
+
+        start = k_uptime_get();
+        int err = connect(sock, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
+        if (err == 0)
+        {
+            sprintf(udp_message, "Churn %d", i);
+            err = send(sock, udp_message, strlen(udp_message), 0);
+        }
+        if (err >= 0)
+        {
+            struct pollfd poll_fd = {
+                .fd = sock,
+                .events = POLLIN,
+            };
+            err = poll(&poll_fd, 1, 5000);
+            if (err == 1)
+            {
+                err = recv(sock, udp_message, sizeof(udp_message), 0);
+            }
+            else
+            {
+                printf("No reply in round %d\n", i);
+                errors++;
+            }
+        }
+        exchange_ms += k_uptime_get() - start;
+        if (err < 0)
+        {
+            printf("Error in round %d: %d\n", i, err);
+            errors++;
+        }
+
+        start = k_uptime_get();
+        close(sock);
+        close_ms += k_uptime_get() - start;
+    }
+    s64_t modem_ms = churn_unpooled();
+    printf("socket(): %d ms, close(): %d ms, exchange: %d ms, "
+           "AT+NSOCR and AT+NSOCL: %d ms (average per round)\n",
+           (int)(open_ms / CHURN_ROUNDS), (int)(close_ms / CHURN_ROUNDS),
+           (int)(exchange_ms / CHURN_ROUNDS), (int)(modem_ms / CHURN_ROUNDS));
+    if (errors > 0 || modem_ms < 0)
+    {
+        printf("Socket churn failed: %d rounds failed, modem round trips %s\n",
+               errors, modem_ms < 0 ? "failed" : "ok");
+        return;
+    }
+    if (CONFIG_N2_SOCKET_POOL_SIZE > 0 && (open_ms + close_ms) * 2 >= modem_ms)
+    {
+        printf("Socket churn failed: the pool isn't faster than the modem\n");
+        return;
+    }
+    printf("Socket churn passed\n");
+}
+
+#define RECV_TIMEOUT_MS 500
+// How late a timeout may return, and how long a non-blocking call may take
+#define TIMEOUT_SLACK_MS 100
+
+/**
+ * @brief Time a recv() that should fail with EAGAIN.
+ * @return Time in ms, -1 if the call didn't fail with EAGAIN
+ */
+static int recv_eagain_ms(int sock)
+{
+    s64_t start = k_uptime_get();
+    errno = 0;
+    int err = recv(sock, udp_message, sizeof(udp_message), 0);
+    int ms = k_uptime_get() - start;
+    if (err >= 0 || errno != EAGAIN)
+    {
+        printf("recv returned %d (errno %d), expected EAGAIN\n", err, errno);
+        return -1;
+    }
+    return ms;
+}
+
+// Check that a blocking recv() returns when SO_RCVTIMEO expires and that a
+// non-blocking one returns right away. Nothing is sent so nothing arrives.
+void testUDPTimeout()
+{
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        printf("Socket timeout failed: error opening socket: %d\n", sock);
+        return;
+    }
+    struct sockaddr_in remote_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(1234),
+    };
+    net_addr_pton(AF_INET, "172.16.15.14", &remote_addr.sin_addr);
+    connect(sock, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
+
+    struct timeval tv = {
+        .tv_sec = 0,
+        .tv_usec = RECV_TIMEOUT_MS * USEC_PER_MSEC,
+    };
+    int err = setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    if (err < 0)
+    {
+        printf("Socket timeout failed: error setting SO_RCVTIMEO: %d\n", err);
+        close(sock);
+        return;
+    }
+    int blocking_ms = recv_eagain_ms(sock);
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+    int nonblocking_ms = recv_eagain_ms(sock);
+    close(sock);
+
+    printf("Blocking recv returned after %d ms (timeout %d ms), non-blocking after %d ms\n",
+           blocking_ms, RECV_TIMEOUT_MS, nonblocking_ms);
+    if (blocking_ms < RECV_TIMEOUT_MS || blocking_ms > RECV_TIMEOUT_MS + TIMEOUT_SLACK_MS ||
+        nonblocking_ms < 0 || nonblocking_ms > TIMEOUT_SLACK_MS)
+    {
+        printf("Socket timeout failed\n");
+        return;
+    }
+    printf("Socket timeout passed\n");
+}
+
+#define STRESS_ROUNDS 10
+#define STRESS_BURST 4
+#define STRESS_STACK 1024
+
+K_THREAD_STACK_DEFINE(stress_stack, STRESS_STACK);
+static struct k_thread stress_thread;
+static K_SEM_DEFINE(stress_done, 0, 1);
+static int stress_lost[2];
+
+// Send bursts of datagrams and read the echoes back. The +NSONMI URCs for
+// one socket arrive while the other socket has a send or a read in flight
+// on the modem.
+static void stress_run(int id)
+{
+    char msg[32];
+    int lost = 0;
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock < 0)
+    {
+        printf("Error opening socket: %d\n", sock);
+        stress_lost[id] = STRESS_ROUNDS * STRESS_BURST;
+        return;
+    }
+    struct sockaddr_in remote_addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(1234),
+    };
+    net_addr_pton(AF_INET, "172.16.15.14", &remote_addr.sin_addr);
+    connect(sock, (struct sockaddr *)&remote_addr, sizeof(remote_addr));
+
+    struct timeval tv = {
+        .tv_sec = 5,
+    };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    for (int round = 0; round < STRESS_ROUNDS; round++)
+    {
+        for (int i = 0; i < STRESS_BURST; i++)
+        {
+            sprintf(msg, "Stress %d:%d:%d", id, round, i);
+            send(sock, msg, strlen(msg), 0);
+        }
+        for (int i = 0; i < STRESS_BURST; i++)
+        {
+            if (recv(sock, msg, sizeof(msg), 0) <= 0)
+            {
+                // The URC was lost or the echo never came back
+                lost++;
+            }
+        }
+    }
+    close(sock);
+    stress_lost[id] = lost;
+}
+
+static void stress_threadproc(void)
+{
+    stress_run(1);
+    k_sem_give(&stress_done);
+}
+
+// Two sockets send and receive at the same time. The driver statistics
+// must not show any URC lines that were dropped or any bytes lost to a full
+// receive buffer. The simulated modem echoes every datagram, so a +NSONMI
+// that went missing in the driver also shows up as a lost echo.
+void testUDPStress()
+{
+    printf("Stress test, %d datagrams per socket\n", STRESS_ROUNDS * STRESS_BURST);
+    u32_t urc_dropped = stats_get()->urc_dropped;
+    u32_t rx_overflow = stats_get()->rx_overflow;
+    k_thread_create(&stress_thread, stress_stack,
+                    K_THREAD_STACK_SIZEOF(stress_stack),
+                    (k_thread_entry_t)stress_threadproc,
+                    NULL, NULL, NULL, K_PRIO_PREEMPT(7), 0, K_NO_WAIT);
+    stress_run(0);
+    k_sem_take(&stress_done, K_FOREVER);
+    urc_dropped = stats_get()->urc_dropped - urc_dropped;
+    rx_overflow = stats_get()->rx_overflow - rx_overflow;
+    printf("Stress test: %u URC lines dropped, %u bytes lost to RX overflow, "
+           "lost %d and %d echoes\n",
+           urc_dropped, rx_overflow, stress_lost[0], stress_lost[1]);
+    if (urc_dropped > 0 || rx_overflow > 0 || stress_lost[0] > 0 || stress_lost[1] > 0)
+    {
+        printf("Stress test failed\n");
+        return;
+    }
+    printf("Stress test passed\n");
+}
@@ -1,4 +1,7 @@
 #pragma once
 
 void testUDP();
-void testUDPCounter();
\ No newline at end of file
+void testUDPCounter();
+void testUDPChurn();
+void testUDPTimeout();
+void testUDPStress();
\ No newline at end of file
@@ -0,0 +1,132 @@
+#include <zephyr.h>
+#include <string.h>
+#include <stdio.h>
+#include "trace.h"
+#include "hex.h"
+
+#if CONFIG_N2_TRACE_SIZE > 0
+
+// Record header. The data follows right after it. The layout is part of the
+// dump format (little endian, no padding).
+struct trace_hdr
+{
+    // Length of the data
+    uint8_t len;
+    uint8_t type;
+    uint16_t arg;
+    uint32_t cycles;
+};
+
+// Version of the dump format
+#define TRACE_VERSION 1
+
+#define RECORD_SIZE (sizeof(struct trace_hdr) + TRACE_DATA_SIZE)
+
+static uint8_t ring[CONFIG_N2_TRACE_SIZE];
+// Free running offsets of the oldest record and the end of the newest. The
+// ring size is a power of two so the offsets can wrap.
+static uint32_t tail;
+static uint32_t head;
+
+static void ring_write(uint32_t pos, const void *src, size_t len)
+{
+    size_t off = pos % CONFIG_N2_TRACE_SIZE;
+    size_t n = MIN(len, CONFIG_N2_TRACE_SIZE - off);
+    memcpy(ring + off, src, n);
+    memcpy(ring, (const uint8_t *)src + n, len - n);
+}
+
+static void ring_read(uint32_t pos, void *dst, size_t len)
+{
+    size_t off = pos % CONFIG_N2_TRACE_SIZE;
+    size_t n = MIN(len, CONFIG_N2_TRACE_SIZE - off);
+    memcpy(dst, ring + off, n);
+    memcpy((uint8_t *)dst + n, ring, len - n);
+}
+
+void trace_put(enum trace_type type, uint16_t arg, const void *data, size_t len)
+{
+    struct trace_hdr hdr = {
+        .len = MIN(len, TRACE_DATA_SIZE),
+        .type = type,
+        .arg = arg,
+    };
+    size_t size = sizeof(hdr) + hdr.len;
+
+    unsigned int key = irq_lock();
+    hdr.cycles = k_cycle_get_32();
+    // Drop the oldest records to make room
+    while (head - tail + size > CONFIG_N2_TRACE_SIZE)
+    {
+        tail += sizeof(struct trace_hdr) + ring[tail % CONFIG_N2_TRACE_SIZE];
+    }
+    ring_write(head, &hdr, sizeof(hdr));
+    ring_write(head + sizeof(hdr), data, hdr.len);
+    head += size;
+    irq_unlock(key);
+}
+
+void trace_clear(void)
+{
+    unsigned int key = irq_lock();
+    tail = head;
+    irq_unlock(key);
+}
+
+/**
+ * @brief Copy the record at a position.
+ * @param *pos: Position of the record. Moved to the oldest record if it has
+ *        been overwritten, and on to the next record.
+ * @param *rec: Buffer for the record, RECORD_SIZE bytes
+ * @return Size of the record, 0 if there are no more records
+ */
+static size_t trace_next(uint32_t *pos, uint8_t *rec)
+{
+    size_t size = 0;
+    unsigned int key = irq_lock();
+    if ((int32_t)(*pos - tail) < 0)
+    {
+        *pos = tail;
+    }
+    if (*pos != head)
+    {
+        size = sizeof(struct trace_hdr) + ring[*pos % CONFIG_N2_TRACE_SIZE];
+        ring_read(*pos, rec, size);
+        *pos += size;
+    }
+    irq_unlock(key);
+    return size;
+}
+
+void trace_print(trace_print_t print, void *ctx)
+{
+    uint8_t rec[RECORD_SIZE];
+    char line[2 * RECORD_SIZE + 5];
+    size_t size;
+
+    unsigned int key = irq_lock();
+    uint32_t pos = tail;
+    irq_unlock(key);
+
+    sprintf(line, "n2trace %d %u", TRACE_VERSION, sys_clock_hw_cycles_per_sec());
+    print(ctx, line);
+    while ((size = trace_next(&pos, rec)) > 0)
+    {
+        strcpy(line, "n2t ");
+        line[4 + hex_encode(rec, size, line + 4)] = 0;
+        print(ctx, line);
+    }
+    print(ctx, "n2trace end");
+}
+
+static void print_printk(void *ctx, const char *line)
+{
+    printk("%s\n", line);
+}
+
+void trace_dump(void)
+{
+    trace_print(print_printk, NULL);
+}
+
+#endif
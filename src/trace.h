@@ -0,0 +1,79 @@
+#pragma once
+
+#include <zephyr.h>
+#include "config.h"
+
+/*
+ * Binary trace of the AT traffic. Records are timestamped with
+ * k_cycle_get_32() and kept in a ring buffer that overwrites the oldest
+ * records, so it can be left on. Dump it with "n2 trace" or trace_dump() and
+ * decode the output with tools/n2trace.py.
+ */
+
+/**
+ * @brief Record types. The values are part of the dump format.
+ */
+enum trace_type
+{
+    // Command written to the modem. The data is the start of the command and
+    // arg is the payload length for commands with a binary payload.
+    TRACE_TX = 1,
+    // The first bytes received after a command. Recorded from the UART
+    // interrupt; arg is the number of bytes.
+    TRACE_RX_FIRST = 2,
+    // A response line parsed by the modem thread. arg is the full length of
+    // the line; the data is the start of it.
+    TRACE_RX = 3,
+    // A URC line, as TRACE_RX
+    TRACE_URC = 4,
+    // The command completed. arg is the result (AT_OK, AT_ERROR or
+    // AT_TIMEOUT).
+    TRACE_DONE = 5,
+};
+
+// Maximum number of data bytes in a record. Longer data is truncated.
+#define TRACE_DATA_SIZE 48
+
+/**
+ * @brief Output function for trace_print(). Called once per line.
+ */
+typedef void (*trace_print_t)(void *ctx, const char *line);
+
+#if CONFIG_N2_TRACE_SIZE > 0
+
+/**
+ * @brief Add a record. Can be called from interrupts.
+ * @param type: Record type
+ * @param arg: Type specific argument
+ * @param *data: Record data, truncated to TRACE_DATA_SIZE
+ * @param len: Length of the data
+ */
+void trace_put(enum trace_type type, uint16_t arg, const void *data, size_t len);
+
+/**
+ * @brief Remove all records.
+ */
+void trace_clear(void);
+
+/**
+ * @brief Print the records in the format read by tools/n2trace.py. The oldest
+ *        records are printed first. Records added while printing are
+ *        included.
+ * @param print: Output function
+ * @param *ctx: Passed on to the output function
+ */
+void trace_print(trace_print_t print, void *ctx);
+
+/**
+ * @brief Print the records with printk.
+ */
+void trace_dump(void);
+
+#else
+
+#define trace_put(type, arg, data, len)
+#define trace_clear()
+#define trace_print(print, ctx)
+#define trace_dump()
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "urc.h"
+
+// Number of hash buckets. Must be a power of two.
+#define URC_BUCKETS 16
+
+static struct urc_handler *buckets[URC_BUCKETS];
+
+// FNV-1a over the name, folded into the bucket index
+static unsigned int urc_hash(const char *name, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return (h ^ (h >> 16)) & (URC_BUCKETS - 1);
+}
+
+void urc_register(struct urc_handler *handler)
+{
+    handler->name_len = strlen(handler->name);
+    unsigned int b = urc_hash(handler->name, handler->name_len);
+    handler->next = buckets[b];
+    // The dispatcher sees either the old or the new list head
+    buckets[b] = handler;
+}
+
+/**
+ * @brief Split the arguments after the colon. Quotes and leading spaces
+ *        are removed and each argument is NUL terminated in place.
+ * @return Number of arguments
+ */
+static int urc_split(char *p, char *end, char **fields)
+{
+    int count = 0;
+    while (p < end && count < URC_MAX_ARGS)
+    {
+        while (p < end && *p == ' ')
+        {
+            p++;
+        }
+        bool quoted = (p < end && *p == '"');
+        if (quoted)
+        {
+            p++;
+        }
+        fields[count++] = p;
+        while (p < end && (quoted ? *p != '"' : *p != ','))
+        {
+            p++;
+        }
+        if (quoted && p < end)
+        {
+            // Closing quote. Skip to the next separator.
+            *p++ = 0;
+            while (p < end && *p != ',')
+            {
+                p++;
+            }
+        }
+        if (p < end)
+        {
+            *p++ = 0;
+        }
+    }
+    *end = 0;
+    return count;
+}
+
+int urc_dispatch(char *line, size_t len)
+{
+    if (len == 0 || line[0] != '+')
+    {
+        return 0;
+    }
+    char *end = line + len;
+    char *colon = memchr(line, ':', len);
+    size_t name_len = colon ? (size_t)(colon - line) : len;
+    unsigned int b = urc_hash(line, name_len);
+
+    char *fields[URC_MAX_ARGS];
+    int nfields = -1;
+    int called = 0;
+    for (struct urc_handler *h = buckets[b]; h; h = h->next)
+    {
+        if (h->name_len != name_len || strncmp(h->name, line, name_len) != 0)
+        {
+            continue;
+        }
+        if (nfields < 0)
+        {
+            // Split once, on the first match
+            nfields = colon ? urc_split(colon + 1, end, fields) : 0;
+        }
+        union urc_arg args[URC_MAX_ARGS];
+        int count = 0;
+        for (const char *f = h->format; *f && count < nfields; f++, count++)
+        {
+            switch (*f)
+            {
+            case 'i':
+                args[count].i = strtol(fields[count], NULL, 10);
+                break;
+            case 's':
+                args[count].s = fields[count];
+                break;
+            default:
+                args[count].s = NULL;
+                break;
+            }
+        }
+        h->callback(args, count, h->ctx);
+        called++;
+    }
+    return called;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * Dispatcher for unsolicited result codes (URCs) from the modem. Subsystems
+ * register a handler for a URC name (ie "+NSONMI") and get the arguments
+ * parsed according to a format string. Handlers are kept in hash buckets
+ * keyed on the name so dispatching a line costs a hash and (usually) a
+ * single compare regardless of the number of handlers.
+ */
+
+// Maximum number of arguments parsed for a URC
+#define URC_MAX_ARGS 6
+
+/**
+ * @brief A parsed URC argument. Strings have the quotes removed and are
+ *        only valid during the callback.
+ */
+union urc_arg
+{
+    int i;
+    const char *s;
+};
+
+/**
+ * @brief Callback for a URC. Runs on the modem thread so it must not block
+ *        or wait for an AT command.
+ * @param *args: The arguments, typed according to the handler format
+ * @param count: Number of arguments in the URC (up to the format length)
+ * @param *ctx: The context from the handler
+ */
+typedef void (*urc_callback_t)(const union urc_arg *args, int count, void *ctx);
+
+/**
+ * @brief A URC handler. The handler is owned by the caller and must stay
+ *        valid after it is registered.
+ */
+struct urc_handler
+{
+    // URC name including the +, ie "+NSONMI"
+    const char *name;
+    // One character per argument: 'i' is an integer, 's' a string and any
+    // other character skips the argument.
+    const char *format;
+    urc_callback_t callback;
+    void *ctx;
+    // Set by urc_register()
+    struct urc_handler *next;
+    size_t name_len;
+};
+
+/**
+ * @brief Register a handler. Several handlers can be registered for the
+ *        same URC; they are called in reverse order of registration.
+ * @note  Handlers can't be removed. Register them at startup.
+ */
+void urc_register(struct urc_handler *handler);
+
+/**
+ * @brief Dispatch a URC line to the registered handlers.
+ * @param *line: The line without the line ending. It is modified while
+ *        the arguments are parsed.
+ * @param len: Length of the line
+ * @return Number of handlers called
+ */
+int urc_dispatch(char *line, size_t len);
@@ -0,0 +1,160 @@
+#!/usr/bin/env python3
+"""
+Convert captured modem traffic to a replay capture for src/test_replay.c
+(see src/replay.h).
+
+Two kinds of input are read:
+
+  * Trace dumps from "n2 trace dump" or trace_dump() (see tools/n2trace.py).
+    The trace keeps the first 48 characters of each line; lines that were
+    cut short can't be replayed and are reported. In practice this rules out
+    AT+NSORF responses with more than a few bytes of payload, so capture
+    those with a logic analyser. Commands only have to match up to the
+    length that was traced.
+
+  * Logic analyser exports of the UART, one CSV file for each direction
+    (--tx for the lines into the modem, --rx for the lines out of it). The
+    files need a time column (seconds) and a data column with one byte per
+    row, either as a number (0x41, 65) or as the character itself. The
+    async serial exports from Saleae Logic work as they are.
+
+Modem output is split into separate events where the modem paused for more
+than --gap ms so the replay sees the same spans as the driver did.
+
+    $ tools/n2capture.py --trace rtt.log --name nsorf_bench > capture.h
+    $ tools/n2capture.py --tx tx.csv --rx rx.csv --name nsorf_urcs
+"""
+import argparse
+import csv
+import sys
+
+from n2trace import TRACE_RX, TRACE_TX, TRACE_URC, parse_dumps
+
+
+def c_string(data):
+    """Quote bytes as C string literals, split over several lines if long."""
+    out = []
+    line = ""
+    for b in data:
+        c = chr(b)
+        if c == "\r":
+            s = "\\r"
+        elif c == "\n":
+            s = "\\n"
+        elif c in "\"\\":
+            s = "\\" + c
+        elif 32 <= b < 127:
+            s = c
+        else:
+            s = "\\%03o" % b
+        line += s
+        if len(line) >= 64 and c == "\n" or len(line) >= 96:
+            out.append('"%s"' % line)
+            line = ""
+    if line or not out:
+        out.append('"%s"' % line)
+    return "\n     ".join(out)
+
+
+def print_capture(events, name, source):
+    print("// Converted from %s by tools/n2capture.py" % source)
+    print("static const struct replay_event %s[] = {" % name)
+    for direction, data in events:
+        print("    {%s, %s}," % ("REPLAY_TX" if direction == "tx" else "REPLAY_RX", c_string(data)))
+    print("};")
+
+
+def from_trace(path):
+    """Events from the last trace dump in a log."""
+    with open(path, errors="replace") as f:
+        dumps = list(parse_dumps(f))
+    if not dumps:
+        sys.exit("No trace found in %s" % path)
+    _, records = dumps[-1]
+
+    events = []
+    truncated = 0
+    for rec in records:
+        if rec.kind == TRACE_TX:
+            events.append(("tx", rec.data))
+        elif rec.kind in (TRACE_RX, TRACE_URC) and events:
+            # The line as the module sends it. Output from before the first
+            # command is left out since its command isn't in the trace.
+            if rec.arg > len(rec.data):
+                truncated += 1
+            events.append(("rx", b"\r\n" + rec.data + b"\r\n"))
+    if truncated:
+        print("%d lines were cut short in the trace. The trace keeps the first 48 "
+              "characters of each line, which leaves out the payload of most "
+              "AT+NSORF responses. Capture the UART with a logic analyser "
+              "(--tx and --rx) or increase TRACE_DATA_SIZE in src/trace.h "
+              "to replay them" % truncated, file=sys.stderr)
+        sys.exit(1)
+    return events
+
+
+def parse_byte(value):
+    if value.strip():
+        value = value.strip()
+    if len(value) >= 2 and value[0] == value[-1] and value[0] in "'\"":
+        value = value[1:-1]
+    escapes = {"\\r": 13, "\\n": 10, "\\t": 9, "\\0": 0, "\\\\": 92}
+    if value in escapes:
+        return escapes[value]
+    if value.lower().startswith("0x"):
+        return int(value, 16)
+    if value.isdigit() and len(value) > 1:
+        return int(value)
+    if len(value) == 1:
+        return ord(value)
+    raise ValueError("can't read byte %r" % value)
+
+
+def read_csv(path, direction):
+    with open(path, newline="") as f:
+        reader = csv.reader(f)
+        header = [h.strip().lower() for h in next(reader)]
+        time_col = next(i for i, h in enumerate(header) if "time" in h)
+        data_col = next(i for i, h in enumerate(header) if h in ("data", "value"))
+        for row in reader:
+            if len(row) > max(time_col, data_col):
+                yield float(row[time_col]), direction, parse_byte(row[data_col])
+
+
+def from_csv(tx_path, rx_path, gap):
+    """Events from logic analyser exports, merged by time."""
+    rows = sorted(list(read_csv(tx_path, "tx")) + list(read_csv(rx_path, "rx")),
+                  key=lambda r: r[0])
+    events = []
+    last = None
+    for time, direction, byte in rows:
+        if not events or events[-1][0] != direction or \
+           (direction == "rx" and (time - last) * 1000 > gap):
+            events.append((direction, bytearray()))
+        events[-1][1].append(byte)
+        last = time
+    return events
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Convert modem traffic to a replay capture")
+    parser.add_argument("--trace", help="log with a trace dump")
+    parser.add_argument("--tx", help="logic analyser export of the data to the modem")
+    parser.add_argument("--rx", help="logic analyser export of the data from the modem")
+    parser.add_argument("--gap", type=float, default=5.0,
+                        help="pause in ms that splits the modem output into separate events")
+    parser.add_argument("--name", default="capture", help="name of the C array")
+    args = parser.parse_args()
+    if args.trace:
+        events = from_trace(args.trace)
+        source = args.trace
+    elif args.tx and args.rx:
+        events = from_csv(args.tx, args.rx, args.gap)
+        source = "%s and %s" % (args.tx, args.rx)
+    else:
+        parser.error("use --trace or both --tx and --rx")
+    print_capture(events, args.name, source)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,448 @@
+#!/usr/bin/env python3
+"""
+Simulated SARA N2 modem for host side testing of the socket offload driver.
+
+The simulator attaches to a serial device (usually the pseudo terminal that
+the native_posix build prints on startup) and answers the subset of AT
+commands the driver uses:
+
+    AT, ATI, AT+NRB, AT+CGPADDR, AT+CIMI, AT+CPSMS, AT+CEDRXS,
+    AT+CSCON, AT+NPSMR, AT+CEREG, AT+NSOCR, AT+NSOST, AT+NSOSTF, AT+NSORF, AT+NSOCL
+
+Datagrams sent with AT+NSOST are either echoed back to the sender (the
+default) or forwarded to real UDP sockets on the host with --forward. Incoming
+datagrams are announced with +NSONMI URCs and read with AT+NSORF just like
+on the real module.
+
+Sending connects the radio (+CSCON: 1). It goes idle after --inactivity
+seconds, or right away after a send with a release assistance flag, and
+enters PSM (+NPSMR: 1) when the active time set with AT+CPSMS runs out.
+
+Output is paced at the configured baud rate and every response is delayed by
+--latency milliseconds so throughput and latency numbers measured against the
+simulator are in the same ballpark as on the bench.
+
+    $ build/zephyr/zephyr.exe
+    UART_0 connected to pseudotty: /dev/pts/5
+    $ tools/n2sim.py /dev/pts/5 --baud 9600 --latency 50
+"""
+import argparse
+import heapq
+import os
+import select
+import socket
+import sys
+import time
+import tty
+
+MAX_SOCKETS = 7
+MAX_NSORF = 512
+IMSI = "242016000001234"
+IP_ADDRESS = "10.0.0.2"
+
+# Units for the GPRS timer 2 (T3324, active time) in AT+CPSMS, in seconds
+ACTIVE_TIME_UNITS = {0b000: 2, 0b001: 60, 0b010: 360}
+
+
+class Datagram:
+    def __init__(self, ip, port, data):
+        self.ip = ip
+        self.port = port
+        self.data = data
+
+
+class ModemSocket:
+    def __init__(self, fd, local_port, forward):
+        self.fd = fd
+        self.local_port = local_port
+        self.rx = []
+        self.udp = None
+        if forward:
+            self.udp = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+            self.udp.bind(("0.0.0.0", 0))
+            self.udp.setblocking(False)
+
+    def close(self):
+        if self.udp:
+            self.udp.close()
+
+
+class Modem:
+    def __init__(self, args):
+        self.args = args
+        self.fd = os.open(args.tty, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.fd)
+        self.line = b""
+        self.outq = bytearray()
+        self.next_tx = 0.0
+        self.rx_done = 0.0
+        self.events = []
+        self.seq = 0
+        self.sockets = {}
+        self.attached_at = time.monotonic() + args.attach_time
+        self.cfun = 1
+        self.byte_time = 10.0 / args.baud
+        self.cscon = False
+        self.npsmr = False
+        self.cereg = 0
+        self.reg_gen = 0
+        if args.warm:
+            # Left running by a previous run of the application, with the
+            # sockets it had open
+            self.attached_at = time.monotonic()
+            for fd in range(min(args.stale_sockets, MAX_SOCKETS)):
+                self.sockets[fd] = ModemSocket(fd, 6000 + fd, args.forward)
+        else:
+            self.schedule(args.attach_time, self.attach, self.reg_gen)
+        self.psm_active_time = None
+        self.connected = False
+        self.in_psm = False
+        # Bumped on every radio event so stale timers can be ignored
+        self.radio_gen = 0
+        self.handlers = {
+            "AT": self.at_ok,
+            "ATI": self.ati,
+            "AT+NRB": self.nrb,
+            "AT+CGPADDR": self.cgpaddr,
+            "AT+CIMI": self.cimi,
+            "AT+CFUN": self.set_cfun,
+            "AT+CFUN?": self.get_cfun,
+            "AT+CPSMS": self.cpsms,
+            "AT+CEDRXS": self.at_ok,
+            "AT+CSCON": self.set_cscon,
+            "AT+NPSMR": self.set_npsmr,
+            "AT+CEREG": self.set_cereg,
+            "AT+CEREG?": self.get_cereg,
+            "AT+NSOCR": self.nsocr,
+            "AT+NSOST": self.nsost,
+            "AT+NSOSTF": self.nsostf,
+            "AT+NSORF": self.nsorf,
+            "AT+NSOCL": self.nsocl,
+        }
+
+    def log(self, msg):
+        if self.args.verbose:
+            print("%10.3f %s" % (time.monotonic(), msg), file=sys.stderr)
+
+    # Scheduling -------------------------------------------------------------
+
+    def schedule(self, delay, fn, *args):
+        self.seq += 1
+        heapq.heappush(self.events, (time.monotonic() + delay, self.seq, fn, args))
+
+    def respond(self, *lines, result="OK"):
+        """Queue response lines after the command has been received in full
+        and the configured latency has passed."""
+        delay = max(0.0, self.rx_done - time.monotonic()) + self.args.latency / 1000.0
+        payload = b""
+        for l in lines:
+            payload += b"\r\n" + l.encode() + b"\r\n"
+        if result:
+            payload += b"\r\n" + result.encode() + b"\r\n"
+        self.schedule(delay, self.emit, payload)
+
+    def urc(self, line):
+        self.emit(b"\r\n" + line.encode() + b"\r\n")
+
+    def emit(self, data):
+        self.log("<- %r" % data)
+        self.outq += data
+
+    # Command handlers -------------------------------------------------------
+
+    def at_ok(self, params):
+        self.respond()
+
+    def ati(self, params):
+        self.respond("u-blox", "SARA-N211 (simulated)")
+
+    def cpsms(self, params):
+        try:
+            if int(params[0]) == 0:
+                self.psm_active_time = None
+            else:
+                bits = int(params[4], 2)
+                unit = ACTIVE_TIME_UNITS[bits >> 5]
+                self.psm_active_time = unit * (bits & 0x1F)
+        except (IndexError, ValueError, KeyError):
+            self.respond(result="ERROR")
+            return
+        self.respond()
+
+    def set_cscon(self, params):
+        self.cscon = params[:1] == ["1"]
+        self.respond()
+
+    def set_npsmr(self, params):
+        self.npsmr = params[:1] == ["1"]
+        self.respond()
+
+    def set_cereg(self, params):
+        try:
+            self.cereg = int(params[0])
+        except (IndexError, ValueError):
+            self.respond(result="ERROR")
+            return
+        self.respond()
+
+    def set_cfun(self, params):
+        try:
+            self.cfun = int(params[0])
+        except (IndexError, ValueError):
+            self.respond(result="ERROR")
+            return
+        self.respond()
+
+    def get_cfun(self, params):
+        self.respond("+CFUN: %d" % self.cfun)
+
+    def registration(self):
+        return 1 if time.monotonic() >= self.attached_at else 2
+
+    def get_cereg(self, params):
+        self.respond("+CEREG: %d,%d" % (self.cereg, self.registration()))
+
+    def attach(self, gen):
+        if gen != self.reg_gen:
+            return
+        if self.cereg:
+            self.urc("+CEREG: 1")
+
+    # Radio state ------------------------------------------------------------
+
+    def radio_connect(self, release):
+        """A send connects the radio. It is released after the inactivity
+        timer or right away when the send has a release assistance flag."""
+        self.radio_gen += 1
+        if self.in_psm:
+            self.in_psm = False
+            if self.npsmr:
+                self.urc("+NPSMR: 0")
+        if not self.connected:
+            self.connected = True
+            if self.cscon:
+                self.urc("+CSCON: 1")
+        delay = self.args.rtt / 1000.0 if release else self.args.inactivity
+        self.schedule(delay, self.radio_release, self.radio_gen)
+
+    def radio_release(self, gen):
+        if gen != self.radio_gen or not self.connected:
+            return
+        self.connected = False
+        if self.cscon:
+            self.urc("+CSCON: 0")
+        if self.psm_active_time is not None:
+            self.schedule(self.psm_active_time, self.radio_psm, gen)
+
+    def radio_psm(self, gen):
+        if gen != self.radio_gen:
+            return
+        self.in_psm = True
+        if self.npsmr:
+            self.urc("+NPSMR: 1")
+
+    def nrb(self, params):
+        for s in self.sockets.values():
+            s.close()
+        self.sockets = {}
+        self.cscon = self.npsmr = self.connected = self.in_psm = False
+        self.cereg = 0
+        self.cfun = 1
+        self.radio_gen += 1
+        self.reg_gen += 1
+        self.attached_at = time.monotonic() + self.args.reboot_time + self.args.attach_time
+        self.schedule(self.args.reboot_time + self.args.attach_time, self.attach, self.reg_gen)
+        self.emit(b"\r\nREBOOTING\r\n")
+        self.schedule(self.args.reboot_time, self.emit,
+                      b"\r\nu-blox\r\n\r\nOK\r\n")
+
+    def cgpaddr(self, params):
+        if time.monotonic() >= self.attached_at:
+            self.respond('+CGPADDR: 0,"%s"' % IP_ADDRESS)
+        else:
+            self.respond("+CGPADDR: 0")
+
+    def cimi(self, params):
+        self.respond(IMSI)
+
+    def nsocr(self, params):
+        free = [i for i in range(MAX_SOCKETS) if i not in self.sockets]
+        if len(params) < 3 or not free:
+            self.respond(result="ERROR")
+            return
+        fd = free[0]
+        self.sockets[fd] = ModemSocket(fd, int(params[2]), self.args.forward)
+        self.respond(str(fd))
+
+    def nsost(self, params, release=False):
+        try:
+            fd, ip, port, length = int(params[0]), params[1], int(params[2]), int(params[3])
+            data = bytes.fromhex(params[4])
+        except (IndexError, ValueError):
+            self.respond(result="ERROR")
+            return
+        sock = self.sockets.get(fd)
+        if sock is None or length != len(data) or length > MAX_NSORF:
+            self.respond(result="ERROR")
+            return
+        self.respond("%d,%d" % (fd, length))
+        self.radio_connect(release)
+        if sock.udp:
+            sock.udp.sendto(data, (ip, port))
+        else:
+            self.schedule(self.args.rtt / 1000.0, self.deliver, fd, Datagram(ip, port, data))
+
+    def nsostf(self, params):
+        # Same as AT+NSOST with a flag before the length
+        try:
+            flag = int(params[3], 16)
+        except (IndexError, ValueError):
+            self.respond(result="ERROR")
+            return
+        if flag not in (0x000, 0x100, 0x200, 0x400):
+            self.respond(result="ERROR")
+            return
+        self.log("   release assistance flag 0x%03X" % flag)
+        self.nsost(params[:3] + params[4:], release=flag in (0x200, 0x400))
+
+    def nsorf(self, params):
+        try:
+            fd, length = int(params[0]), int(params[1])
+        except (IndexError, ValueError):
+            self.respond(result="ERROR")
+            return
+        sock = self.sockets.get(fd)
+        if sock is None or length > MAX_NSORF:
+            self.respond(result="ERROR")
+            return
+        if not sock.rx:
+            self.respond()
+            return
+        dgram = sock.rx[0]
+        chunk, dgram.data = dgram.data[:length], dgram.data[length:]
+        if not dgram.data:
+            sock.rx.pop(0)
+        self.respond('%d,"%s",%d,%d,"%s",%d' % (
+            fd, dgram.ip, dgram.port, len(chunk), chunk.hex().upper(), len(dgram.data)))
+
+    def nsocl(self, params):
+        try:
+            sock = self.sockets.pop(int(params[0]))
+        except (IndexError, ValueError, KeyError):
+            self.respond(result="ERROR")
+            return
+        sock.close()
+        self.respond()
+
+    def deliver(self, fd, dgram):
+        sock = self.sockets.get(fd)
+        if sock is None:
+            return
+        sock.rx.append(dgram)
+        self.urc("+NSONMI: %d,%d" % (fd, len(dgram.data)))
+
+    # I/O --------------------------------------------------------------------
+
+    def command(self, line):
+        self.log("-> %r" % line)
+        text = line.decode(errors="replace").strip()
+        if not text:
+            return
+        name, _, rest = text.partition("=")
+        params = [p.strip('"') for p in rest.split(",")] if rest else []
+        handler = self.handlers.get(name.upper())
+        if handler is None:
+            self.respond(result="ERROR")
+            return
+        handler(params)
+
+    def read_uart(self):
+        data = os.read(self.fd, 4096)
+        if not data:
+            raise EOFError()
+        # Pace the input as well; the modem doesn't see the end of a command
+        # before the last byte has been clocked in.
+        now = time.monotonic()
+        self.rx_done = max(self.rx_done, now) + len(data) * self.byte_time
+        for b in data:
+            c = bytes([b])
+            if c in (b"\r", b"\n"):
+                if self.line:
+                    self.command(self.line)
+                self.line = b""
+            else:
+                self.line += c
+
+    def write_uart(self):
+        now = time.monotonic()
+        if not self.outq or now < self.next_tx:
+            return
+        count = max(1, int((now - self.next_tx) / self.byte_time))
+        chunk = bytes(self.outq[:count])
+        del self.outq[:count]
+        os.write(self.fd, chunk)
+        self.next_tx = max(self.next_tx, now - self.byte_time) + len(chunk) * self.byte_time
+
+    def read_udp(self, sock):
+        try:
+            data, (ip, port) = sock.udp.recvfrom(65535)
+        except BlockingIOError:
+            return
+        self.deliver(sock.fd, Datagram(ip, port, data))
+
+    def run(self):
+        while True:
+            now = time.monotonic()
+            while self.events and self.events[0][0] <= now:
+                _, _, fn, args = heapq.heappop(self.events)
+                fn(*args)
+            self.write_uart()
+
+            timeout = 0.5
+            if self.events:
+                timeout = min(timeout, self.events[0][0] - now)
+            if self.outq:
+                timeout = min(timeout, max(self.next_tx - now, self.byte_time))
+            readers = [self.fd] + [s.udp for s in self.sockets.values() if s.udp]
+            ready, _, _ = select.select(readers, [], [], max(0.0, timeout))
+            for r in ready:
+                if r == self.fd:
+                    self.read_uart()
+                else:
+                    for s in list(self.sockets.values()):
+                        if s.udp is r:
+                            self.read_udp(s)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Simulated SARA N2 modem")
+    parser.add_argument("tty", help="serial device or pseudo terminal to attach to")
+    parser.add_argument("--baud", type=int, default=9600,
+                        help="line rate used to pace data in both directions")
+    parser.add_argument("--latency", type=float, default=20.0,
+                        help="delay in ms between a command and its response")
+    parser.add_argument("--rtt", type=float, default=200.0,
+                        help="network round trip in ms for echoed datagrams")
+    parser.add_argument("--reboot-time", type=float, default=2.0,
+                        help="seconds AT+NRB takes to complete")
+    parser.add_argument("--attach-time", type=float, default=1.0,
+                        help="seconds from boot until an IP address is assigned")
+    parser.add_argument("--inactivity", type=float, default=5.0,
+                        help="seconds without traffic before the radio goes idle")
+    parser.add_argument("--warm", action="store_true",
+                        help="start attached, as after a reset of the application only")
+    parser.add_argument("--stale-sockets", type=int, default=2,
+                        help="sockets left open on the modem with --warm")
+    parser.add_argument("--forward", action="store_true",
+                        help="send datagrams to real UDP sockets instead of echoing them")
+    parser.add_argument("-v", "--verbose", action="store_true",
+                        help="log all traffic to stderr")
+    args = parser.parse_args()
+    try:
+        Modem(args).run()
+    except (EOFError, KeyboardInterrupt):
+        pass
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,164 @@
+#!/usr/bin/env python3
+"""
+Decode the AT trace printed by "n2 trace dump" or trace_dump() (see
+src/trace.h).
+
+The dump can be mixed with other output, ie a saved RTT log or the output from
+the native_posix build. Every dump in the input is decoded into a timeline
+with the time of each record relative to the first one and to the previous
+one, followed by a breakdown of where the time went for each command:
+
+    first   from the command being written until the first bytes of the
+            response arrive (the UART and the modem)
+    parse   from the first bytes until the command completes (the rest of the
+            response and the modem thread)
+
+    $ tools/n2trace.py rtt.log
+    $ build/zephyr/zephyr.exe | tee run.log; tools/n2trace.py run.log
+"""
+import argparse
+import struct
+import sys
+
+TRACE_TX = 1
+TRACE_RX_FIRST = 2
+TRACE_RX = 3
+TRACE_URC = 4
+TRACE_DONE = 5
+
+HEADER = struct.Struct("<BBHI")
+RESULTS = {0: "OK", -1: "ERROR", -2: "TIMEOUT"}
+
+
+class Record:
+    def __init__(self, kind, arg, cycles, data):
+        self.kind = kind
+        self.arg = arg
+        self.cycles = cycles
+        self.data = data
+        self.time = 0.0
+
+
+def parse_dumps(lines):
+    """Yield (cycles per second, records) for each dump in the input."""
+    hz = None
+    records = []
+    for line in lines:
+        if "n2trace end" in line:
+            if hz:
+                yield hz, records
+            hz = None
+        elif "n2trace " in line:
+            fields = line[line.index("n2trace "):].split()
+            if len(fields) >= 3 and fields[1] == "1":
+                hz = int(fields[2])
+                records = []
+            elif len(fields) >= 2:
+                print("Unsupported trace version %s" % fields[1], file=sys.stderr)
+        elif "n2t " in line and hz:
+            raw = bytes.fromhex(line[line.index("n2t ") + 4:].strip())
+            if len(raw) < HEADER.size:
+                continue
+            length, kind, arg, cycles = HEADER.unpack_from(raw)
+            records.append(Record(kind, arg, cycles, raw[HEADER.size:HEADER.size + length]))
+    if hz and records:
+        # Truncated dump
+        yield hz, records
+
+
+def timestamp(records, hz):
+    """Convert the cycle counts to ms from the first record. The counter
+    wraps so only the differences are used."""
+    elapsed = 0
+    for prev, rec in zip([None] + records, records):
+        if prev:
+            elapsed += (rec.cycles - prev.cycles) & 0xffffffff
+        rec.time = elapsed * 1000.0 / hz
+
+
+def text(rec):
+    return rec.data.decode("ascii", "replace").replace("\r", "").replace("\n", "")
+
+
+def describe(rec):
+    if rec.kind == TRACE_TX:
+        s = "-> " + text(rec)
+        if rec.arg:
+            s += " <%d byte payload>" % rec.arg
+        return s
+    if rec.kind == TRACE_RX_FIRST:
+        return "<- (%d bytes)" % rec.arg
+    if rec.kind in (TRACE_RX, TRACE_URC):
+        s = ("<- " if rec.kind == TRACE_RX else "<! ") + text(rec)
+        if rec.arg > len(rec.data):
+            s += "... (%d chars)" % rec.arg
+        return s
+    if rec.kind == TRACE_DONE:
+        result = struct.unpack("<h", struct.pack("<H", rec.arg))[0]
+        return "== %s" % RESULTS.get(result, result)
+    return "?? type %d" % rec.kind
+
+
+def command_name(rec):
+    s = text(rec)
+    for sep in "=?":
+        if sep in s:
+            s = s[:s.index(sep)]
+    return s
+
+
+def summary(records):
+    """Pair each command with its first response bytes and its completion."""
+    stats = {}
+    cmd = None
+    for rec in records:
+        if rec.kind == TRACE_TX:
+            cmd = {"name": command_name(rec), "tx": rec.time, "first": None}
+        elif cmd and rec.kind == TRACE_RX_FIRST:
+            cmd["first"] = rec.time
+        elif cmd and rec.kind == TRACE_DONE:
+            first = cmd["first"] if cmd["first"] is not None else rec.time
+            entry = stats.setdefault(cmd["name"], [])
+            entry.append((first - cmd["tx"], rec.time - first, rec.time - cmd["tx"]))
+            cmd = None
+    return stats
+
+
+def print_dump(hz, records, timeline):
+    timestamp(records, hz)
+    if timeline:
+        prev = 0.0
+        for rec in records:
+            print("%10.3f %+9.3f  %s" % (rec.time, rec.time - prev, describe(rec)))
+            prev = rec.time
+        print()
+    print("%-10s %5s %21s %21s %21s" % ("command", "count", "first avg/max ms",
+                                         "parse avg/max ms", "total avg/max ms"))
+    for name, entries in sorted(summary(records).items()):
+        cols = []
+        for i in range(3):
+            values = [e[i] for e in entries]
+            cols.append("%10.1f/%10.1f" % (sum(values) / len(values), max(values)))
+        print("%-10s %5d %s %s %s" % (name, len(entries), cols[0], cols[1], cols[2]))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Decode the SARA N2 driver AT trace")
+    parser.add_argument("file", nargs="?", help="log with the dump (default stdin)")
+    parser.add_argument("-s", "--summary", action="store_true",
+                        help="only print the per command breakdown")
+    args = parser.parse_args()
+    with (open(args.file, errors="replace") if args.file else sys.stdin) as f:
+        found = False
+        for hz, records in parse_dumps(f):
+            if found:
+                print()
+            found = True
+            print_dump(hz, records, not args.summary)
+    if not found:
+        print("No trace found", file=sys.stderr)
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()